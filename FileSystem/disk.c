@@ -1,90 +1,1273 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <errno.h>
-#include <string.h>
-
-#include "disk.h"
-
-#define DISK_MAGIC 0xdeadbeef
-
-static FILE *diskfile;
-static int nblocks=0;
-static int nreads=0;
-static int nwrites=0;
-
-int disk_init( const char *filename, int n )
-{
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
-
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
-
-	nblocks = n;
-	nreads = 0;
-	nwrites = 0;
-
-	return 1;
-}
-
-int disk_size()
-{
-	return nblocks;
-}
-
-static void sanity_check( int blocknum, const void *data )
-{
-	if(blocknum<0) {
-		printf("ERROR: blocknum (%d) is negative!\n",blocknum);
-		abort();
-	}
-
-	if(blocknum>=nblocks) {
-		printf("ERROR: blocknum (%d) is too big!\n",blocknum);
-		abort();
-	}
-
-	if(!data) {
-		printf("ERROR: null data pointer!\n");
-		abort();
-	}
-}
-
-void disk_read( int blocknum, char *data )
-{
-	sanity_check(blocknum,data);
-
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
-
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
-	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
-	}
-}
-
-void disk_write( int blocknum, const char *data )
-{
-	sanity_check(blocknum,data);
-
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
-
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
-	} else {
-		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
-		abort();
-	}
-}
-
-void disk_close()
-{
-	if(diskfile) {
-		printf("%d disk block reads\n",nreads);
-		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
-	}
-}
\ No newline at end of file
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+
+#define DISK_MAGIC 0xdeadbeef
+#define DISK_DISCARD_RANGES 64
+#define DISK_COPY_CHUNK (1<<20)
+#define DISK_CACHE_BYTES (8<<20)
+#define DISK_DIRTY_AGE_MS 500
+#define DISK_FLUSH_INTERVAL_MS 100
+
+struct disk_range {
+	int64_t start;
+	int64_t count;
+};
+
+//Waited on by the caller until every device has finished its part
+struct disk_request {
+	int pending;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+//The part of a request that lands on one device, contiguous on that device
+struct disk_job {
+	int write;
+	off_t offset;
+	off_t length;
+	struct iovec *iov;
+	int iovcnt;
+	struct disk_request *request;
+	struct disk_job *next;
+};
+
+struct disk_device {
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct disk_job *queue;
+	struct disk_job *tail;
+	int stop;
+};
+
+static struct disk_device devices[DISK_MAX_DEVICES];
+static int ndevices=0;
+static off_t stripe_unit=DISK_STRIPE_UNIT;
+static int64_t nblocks=0;
+static int block_size=DISK_BLOCK_SIZE;
+static int64_t nreads=0;
+static int64_t nwrites=0;
+static int64_t ndiscards=0;
+
+//Freed blocks waiting to be punched out of the image, kept as ranges
+static struct disk_range discards[DISK_DISCARD_RANGES];
+static int npending=0;
+
+/*
+Single block reads and writes go through a write-back cache.
+A write returns once the block is in memory; the flusher thread
+writes blocks back after they have been dirty for a while, or
+sooner when most of the cache is dirty.
+
+Clean and dirty entries are kept on separate LRU lists, so the
+next entry to reuse is always the oldest clean one. An entry being
+read in or written back is on neither list. No disk I/O is done
+while holding cache_lock.
+*/
+
+struct disk_cache_list {
+	struct disk_cache_entry *newest;
+	struct disk_cache_entry *oldest;
+};
+
+struct disk_cache_entry {
+	int64_t blocknum;	//-1 while the entry holds nothing
+	int dirty;
+	int inflight;		//a copy is on its way to the disk, so the entry has to stay put
+	int loading;		//the block is being read in, so its data is not there yet
+	long long dirtied;	//when the block last went from clean to dirty, in ms
+	char *data;
+	struct disk_cache_entry *hash;
+	struct disk_cache_list *list;
+	struct disk_cache_entry *newer;
+	struct disk_cache_entry *older;
+};
+
+//Which dirty blocks a writeback should take
+struct disk_block_list {
+	const int64_t *blocks;
+	int count;
+};
+
+static struct disk_cache_entry *cache;
+static struct disk_cache_entry **cache_hash;
+static struct disk_cache_entry **cache_batch;
+static struct disk_cache_list cache_clean;
+static struct disk_cache_list cache_dirty;
+static struct disk_range cache_bypass;	//blocks a ranged write is replacing on disk
+static char *cache_data;
+static char *cache_staging;
+static int ncache=0;
+static int ndirty=0;
+static int64_t nhits=0;
+
+//cache_lock covers the cache, the pending discards and the counters.
+//flush_lock is held for a whole writeback and is always taken before cache_lock.
+//range_lock lets one ranged write at a time go around the cache, and comes first of all.
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t range_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_idle = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flusher_wake;
+static pthread_t flusher;
+static int flusher_stop=0;
+static int flusher_urgent=0;
+
+static void discard_flush();
+
+static void device_io( struct disk_device *d, int write, struct iovec *iov, int iovcnt, off_t offset )
+{
+	while(iovcnt>0) {
+		int count = iovcnt<IOV_MAX ? iovcnt : IOV_MAX;
+		ssize_t actual = write ? pwritev(d->fd,iov,count,offset) : preadv(d->fd,iov,count,offset);
+
+		if(actual<0 && errno==EINTR) continue;
+		if(actual<=0) {
+			printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+			abort();
+		}
+
+		//Step past whatever was transferred, including a short transfer
+		offset += actual;
+		while(actual>0) {
+			if((size_t)actual>=iov->iov_len) {
+				actual -= iov->iov_len;
+				iov++;
+				iovcnt--;
+			} else {
+				iov->iov_base = (char*)iov->iov_base+actual;
+				iov->iov_len -= actual;
+				actual = 0;
+			}
+		}
+	}
+}
+
+static void finish_job( struct disk_job *job )
+{
+	struct disk_request *r = job->request;
+
+	pthread_mutex_lock(&r->lock);
+	if(--r->pending==0) pthread_cond_signal(&r->done);
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void *device_worker( void *arg )
+{
+	struct disk_device *d = arg;
+	struct disk_job *job;
+
+	pthread_mutex_lock(&d->lock);
+	while(1) {
+		while(!d->queue && !d->stop) pthread_cond_wait(&d->ready,&d->lock);
+		if(!d->queue) break;
+
+		job = d->queue;
+		d->queue = job->next;
+		if(!d->queue) d->tail = 0;
+		pthread_mutex_unlock(&d->lock);
+
+		device_io(d,job->write,job->iov,job->iovcnt,job->offset);
+		finish_job(job);
+
+		pthread_mutex_lock(&d->lock);
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	return 0;
+}
+
+static void submit_job( int dev, struct disk_job *job )
+{
+	struct disk_device *d = &devices[dev];
+
+	job->next = 0;
+	pthread_mutex_lock(&d->lock);
+	if(d->tail) d->tail->next = job;
+	else d->queue = job;
+	d->tail = job;
+	pthread_cond_signal(&d->ready);
+	pthread_mutex_unlock(&d->lock);
+}
+
+static off_t device_offset( off_t offset, int *dev )
+{
+	off_t stripe = offset/stripe_unit;
+	*dev = stripe%ndevices;
+	return (stripe/ndevices)*stripe_unit + offset%stripe_unit;
+}
+
+/*
+Split a byte range of the logical image into one job per device.
+Consecutive stripe units on a device are adjacent on that device,
+so each job is a single contiguous run described by its iovecs.
+*/
+
+static void split_range( off_t offset, off_t length, char *data, struct iovec *iov, struct disk_job *jobs )
+{
+	off_t first = offset/stripe_unit;
+	off_t last = (offset+length-1)/stripe_unit;
+	off_t s;
+	int d, dev;
+
+	for(d=0;d<ndevices;d++) {
+		struct disk_job *job = &jobs[d];
+		job->iov = iov;
+		job->iovcnt = 0;
+		job->length = 0;
+
+		//The first stripe unit of this range that falls on device d
+		for(s=first+((d-first%ndevices)+ndevices)%ndevices;s<=last;s+=ndevices) {
+			off_t start = (s==first) ? offset : s*stripe_unit;
+			off_t end = (s==last) ? offset+length : (s+1)*stripe_unit;
+
+			if(!job->iovcnt) job->offset = device_offset(start,&dev);
+			iov->iov_base = data ? data+(start-offset) : 0;
+			iov->iov_len = end-start;
+			job->length += end-start;
+			job->iovcnt++;
+			iov++;
+		}
+	}
+}
+
+static void disk_io( int write, off_t offset, off_t length, char *data )
+{
+	int dev;
+
+	//A range inside one stripe unit goes straight to its device
+	if(ndevices==1 || offset/stripe_unit==(offset+length-1)/stripe_unit) {
+		struct iovec iov = { data, length };
+		off_t devoffset = device_offset(offset,&dev);
+		device_io(&devices[dev],write,&iov,1,devoffset);
+		return;
+	}
+
+	off_t nsegments = (offset+length-1)/stripe_unit - offset/stripe_unit + 1;
+	struct iovec *iov = malloc(nsegments*sizeof(struct iovec));
+	struct disk_job jobs[DISK_MAX_DEVICES];
+	struct disk_request request;
+	int d, inline_dev = -1;
+
+	if(!iov) {
+		printf("ERROR: out of memory for disk request\n");
+		abort();
+	}
+
+	split_range(offset,length,data,iov,jobs);
+
+	request.pending = 0;
+	pthread_mutex_init(&request.lock,0);
+	pthread_cond_init(&request.done,0);
+
+	for(d=0;d<ndevices;d++) {
+		if(!jobs[d].iovcnt) continue;
+		jobs[d].write = write;
+		jobs[d].request = &request;
+		request.pending++;
+	}
+
+	//Hand every device but one to its worker and do the last one here
+	for(d=0;d<ndevices;d++) {
+		if(!jobs[d].iovcnt) continue;
+		if(inline_dev<0) inline_dev = d;
+		else submit_job(d,&jobs[d]);
+	}
+	device_io(&devices[inline_dev],write,jobs[inline_dev].iov,jobs[inline_dev].iovcnt,jobs[inline_dev].offset);
+	finish_job(&jobs[inline_dev]);
+
+	pthread_mutex_lock(&request.lock);
+	while(request.pending) pthread_cond_wait(&request.done,&request.lock);
+	pthread_mutex_unlock(&request.lock);
+
+	pthread_mutex_destroy(&request.lock);
+	pthread_cond_destroy(&request.done);
+	free(iov);
+}
+
+static long long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000LL + ts.tv_nsec/1000000;
+}
+
+static struct disk_cache_entry *cache_lookup( int64_t blocknum )
+{
+	struct disk_cache_entry *e = cache_hash[blocknum%ncache];
+	while(e && e->blocknum!=blocknum) e = e->hash;
+	return e;
+}
+
+static void cache_unlink( struct disk_cache_entry *e )
+{
+	struct disk_cache_list *l = e->list;
+	if(!l) return;
+
+	if(e->newer) e->newer->older = e->older;
+	else l->newest = e->older;
+	if(e->older) e->older->newer = e->newer;
+	else l->oldest = e->newer;
+	e->list = 0;
+}
+
+static void cache_push( struct disk_cache_list *l, struct disk_cache_entry *e, int newest )
+{
+	cache_unlink(e);
+	e->list = l;
+	if(newest) {
+		e->newer = 0;
+		e->older = l->newest;
+		if(l->newest) l->newest->newer = e;
+		else l->oldest = e;
+		l->newest = e;
+	} else {
+		e->older = 0;
+		e->newer = l->oldest;
+		if(l->oldest) l->oldest->older = e;
+		else l->newest = e;
+		l->oldest = e;
+	}
+}
+
+static void cache_touch( struct disk_cache_entry *e )
+{
+	//Entries being read in or written back are on no list until they are done
+	if(e->list && e!=e->list->newest) cache_push(e->list,e,1);
+}
+
+static void cache_insert( struct disk_cache_entry *e, int64_t blocknum )
+{
+	e->blocknum = blocknum;
+	e->hash = cache_hash[blocknum%ncache];
+	cache_hash[blocknum%ncache] = e;
+}
+
+static void cache_reset()
+{
+	int i;
+
+	//The cache holds a fixed number of bytes, so its entry count follows the block size
+	ncache = DISK_CACHE_BYTES/block_size;
+	ndirty = 0;
+	cache_clean.newest = cache_clean.oldest = 0;
+	cache_dirty.newest = cache_dirty.oldest = 0;
+	cache_bypass.count = 0;
+
+	for(i=0;i<ncache;i++) {
+		struct disk_cache_entry *e = &cache[i];
+		e->blocknum = -1;
+		e->dirty = 0;
+		e->inflight = 0;
+		e->loading = 0;
+		e->data = cache_data+(off_t)i*block_size;
+		e->hash = 0;
+		e->list = 0;
+		cache_push(&cache_clean,e,1);
+		cache_hash[i] = 0;
+	}
+}
+
+static void cache_unhash( struct disk_cache_entry *e )
+{
+	struct disk_cache_entry **p = &cache_hash[e->blocknum%ncache];
+	while(*p!=e) p = &(*p)->hash;
+	*p = e->hash;
+	e->blocknum = -1;
+}
+
+/*
+Take the oldest clean entry off its list and out of the hash. With
+nothing clean, the flusher is hurried along and null is returned once
+cache_idle has been signalled, since the lock was dropped meanwhile and
+the caller has to look its block up again.
+*/
+
+static struct disk_cache_entry *cache_victim()
+{
+	struct disk_cache_entry *e = cache_clean.oldest;
+
+	if(!e) {
+		if(!flusher_urgent) {
+			flusher_urgent = 1;
+			pthread_cond_signal(&flusher_wake);
+		}
+		pthread_cond_wait(&cache_idle,&cache_lock);
+		return 0;
+	}
+
+	cache_unlink(e);
+	if(e->blocknum>=0) cache_unhash(e);
+	return e;
+}
+
+static int cache_bypassed( int64_t blocknum )
+{
+	return blocknum>=cache_bypass.start && blocknum<cache_bypass.start+cache_bypass.count;
+}
+
+static void cache_drop( struct disk_cache_entry *e )
+{
+	if(e->dirty) ndirty--;
+	e->dirty = 0;
+
+	//A block on its way to the disk keeps its entry until the write is done
+	if(e->inflight) return;
+
+	//An entry being read in is unhashed here and let go by the reader when it finishes
+	cache_unhash(e);
+	if(e->list) cache_push(&cache_clean,e,0);
+}
+
+static void cache_drop_range( int64_t blocknum, int64_t count )
+{
+	int i;
+
+	if(count<ncache) {
+		for(i=0;i<count;i++) {
+			struct disk_cache_entry *e = cache_lookup(blocknum+i);
+			if(e) cache_drop(e);
+		}
+	} else {
+		for(i=0;i<ncache;i++) {
+			struct disk_cache_entry *e = &cache[i];
+			if(e->blocknum>=blocknum && e->blocknum<blocknum+count) cache_drop(e);
+		}
+	}
+}
+
+static int compare_entries( const void *pa, const void *pb )
+{
+	const struct disk_cache_entry *a = *(struct disk_cache_entry * const *)pa;
+	const struct disk_cache_entry *b = *(struct disk_cache_entry * const *)pb;
+	return (a->blocknum > b->blocknum) - (a->blocknum < b->blocknum);
+}
+
+static int compare_blocks( const void *pa, const void *pb )
+{
+	int64_t a = *(const int64_t *)pa;
+	int64_t b = *(const int64_t *)pb;
+	return (a > b) - (a < b);
+}
+
+static int pick_all( const struct disk_cache_entry *e, const void *arg )
+{
+	return 1;
+}
+
+static int pick_aged( const struct disk_cache_entry *e, const void *arg )
+{
+	return e->dirtied <= *(const long long *)arg;
+}
+
+static int pick_range( const struct disk_cache_entry *e, const void *arg )
+{
+	const struct disk_range *r = arg;
+	return e->blocknum>=r->start && e->blocknum<r->start+r->count;
+}
+
+static int pick_list( const struct disk_cache_entry *e, const void *arg )
+{
+	const struct disk_block_list *l = arg;
+	return bsearch(&e->blocknum,l->blocks,l->count,sizeof(int64_t),compare_blocks)!=0;
+}
+
+/*
+Write back the dirty blocks that pick() accepts, in block order,
+merging neighbours into one request. The caller holds flush_lock.
+The blocks are copied out first, so writers only wait for the copy
+and never for the disk.
+*/
+
+static void cache_writeback( int (*pick)( const struct disk_cache_entry *, const void * ), const void *arg )
+{
+	struct disk_cache_entry *e;
+	int i, n = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	for(e=cache_dirty.oldest;e;e=e->newer) {
+		if(pick(e,arg)) cache_batch[n++] = e;
+	}
+	qsort(cache_batch,n,sizeof(cache_batch[0]),compare_entries);
+
+	for(i=0;i<n;i++) {
+		e = cache_batch[i];
+		memcpy(cache_staging+(off_t)i*block_size,e->data,block_size);
+		cache_unlink(e);
+		e->dirty = 0;
+		e->inflight = 1;
+	}
+	ndirty -= n;
+	pthread_mutex_unlock(&cache_lock);
+
+	for(i=0;i<n;) {
+		int run = 1;
+		while(i+run<n && cache_batch[i+run]->blocknum==cache_batch[i]->blocknum+run) run++;
+		disk_io(1,(off_t)cache_batch[i]->blocknum*block_size,(off_t)run*block_size,cache_staging+(off_t)i*block_size);
+		i += run;
+	}
+
+	//A block written to again during the writeback goes back on the dirty list
+	pthread_mutex_lock(&cache_lock);
+	for(i=0;i<n;i++) {
+		e = cache_batch[i];
+		e->inflight = 0;
+		cache_push(e->dirty ? &cache_dirty : &cache_clean,e,1);
+	}
+	nwrites += n;
+	if(n) pthread_cond_broadcast(&cache_idle);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void *cache_flusher( void *arg )
+{
+	pthread_mutex_lock(&cache_lock);
+	while(!flusher_stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC,&deadline);
+		deadline.tv_nsec += DISK_FLUSH_INTERVAL_MS*1000000L;
+		if(deadline.tv_nsec>=1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		while(!flusher_stop && !flusher_urgent) {
+			if(pthread_cond_timedwait(&flusher_wake,&cache_lock,&deadline)==ETIMEDOUT) break;
+		}
+		if(flusher_stop) break;
+
+		//A mostly dirty cache is written back in full instead of waiting for blocks to age
+		int urgent = flusher_urgent;
+		long long cutoff = now_ms()-DISK_DIRTY_AGE_MS;
+		flusher_urgent = 0;
+		if(!ndirty) continue;
+		pthread_mutex_unlock(&cache_lock);
+
+		pthread_mutex_lock(&flush_lock);
+		cache_writeback(urgent ? pick_all : pick_aged,&cutoff);
+		pthread_mutex_unlock(&flush_lock);
+
+		pthread_mutex_lock(&cache_lock);
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return 0;
+}
+
+int disk_init( const char *filename, int64_t n )
+{
+	return disk_init_striped(&filename,1,n,DISK_STRIPE_UNIT);
+}
+
+int disk_init_striped( const char **filenames, int ndev, int64_t n, int unit )
+{
+	int i;
+
+	if(ndev<1 || ndev>DISK_MAX_DEVICES) return 0;
+	if(unit<DISK_BLOCK_SIZE || unit%DISK_BLOCK_SIZE) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	ndevices = ndev;
+	stripe_unit = unit;
+
+	//Each image holds its share of the stripe units, rounded up to a whole row
+	off_t total = (off_t)n*DISK_BLOCK_SIZE;
+	off_t rows = (total+stripe_unit*ndev-1)/(stripe_unit*ndev);
+	off_t devsize = (ndev==1) ? total : rows*stripe_unit;
+
+	for(i=0;i<ndev;i++) {
+		struct disk_device *d = &devices[i];
+		memset(d,0,sizeof(*d));
+
+		d->fd = open(filenames[i],O_RDWR|O_CREAT,0666);
+		if(d->fd<0 || ftruncate(d->fd,devsize)<0) {
+			if(d->fd>=0) close(d->fd);
+			while(i-->0) close(devices[i].fd);
+			ndevices = 0;
+			return 0;
+		}
+	}
+
+	//A single image needs no helpers; the caller does its I/O directly
+	for(i=0;ndev>1 && i<ndev;i++) {
+		struct disk_device *d = &devices[i];
+		pthread_mutex_init(&d->lock,0);
+		pthread_cond_init(&d->ready,0);
+		pthread_create(&d->thread,0,device_worker,d);
+	}
+
+	nblocks = n;
+	block_size = DISK_BLOCK_SIZE;
+	nreads = 0;
+	nwrites = 0;
+	ndiscards = 0;
+	nhits = 0;
+	npending = 0;
+
+	//Sized for the smallest block size, which has the most entries
+	int maxentries = DISK_CACHE_BYTES/DISK_BLOCK_SIZE;
+	cache = malloc(maxentries*sizeof(*cache));
+	cache_hash = malloc(maxentries*sizeof(*cache_hash));
+	cache_batch = malloc(maxentries*sizeof(*cache_batch));
+	cache_data = malloc(DISK_CACHE_BYTES);
+	cache_staging = malloc(DISK_CACHE_BYTES);
+	if(!cache || !cache_hash || !cache_batch || !cache_data || !cache_staging) {
+		printf("ERROR: out of memory for the block cache\n");
+		abort();
+	}
+	cache_reset();
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+	pthread_cond_init(&flusher_wake,&attr);
+	pthread_condattr_destroy(&attr);
+	flusher_stop = 0;
+	flusher_urgent = 0;
+	pthread_create(&flusher,0,cache_flusher,0);
+
+	return 1;
+}
+
+int disk_set_block_size( int size )
+{
+	//Block sizes are powers of two between the default and the maximum
+	if(size<DISK_BLOCK_SIZE || size>DISK_MAX_BLOCK_SIZE || (size&(size-1))) return 0;
+	if(nblocks*DISK_BLOCK_SIZE<size) return 0;
+
+	//Cached blocks and pending discards are numbered in the old block size
+	pthread_mutex_lock(&flush_lock);
+	cache_writeback(pick_all,0);
+	discard_flush();
+
+	pthread_mutex_lock(&cache_lock);
+	block_size = size;
+	cache_reset();
+	pthread_mutex_unlock(&cache_lock);
+	pthread_mutex_unlock(&flush_lock);
+	return 1;
+}
+
+int disk_block_size()
+{
+	return block_size;
+}
+
+int disk_devices()
+{
+	return ndevices;
+}
+
+int64_t disk_size()
+{
+	//nblocks counts default sized blocks; the image is addressed in the current size
+	return nblocks*DISK_BLOCK_SIZE/block_size;
+}
+
+static void sanity_check( int64_t blocknum, const void *data )
+{
+	if(blocknum<0) {
+		printf("ERROR: blocknum (%lld) is negative!\n",(long long)blocknum);
+		abort();
+	}
+
+	if(blocknum>=disk_size()) {
+		printf("ERROR: blocknum (%lld) is too big!\n",(long long)blocknum);
+		abort();
+	}
+
+	if(!data) {
+		printf("ERROR: null data pointer!\n");
+		abort();
+	}
+}
+
+void disk_read( int64_t blocknum, char *data )
+{
+	struct disk_cache_entry *e;
+
+	sanity_check(blocknum,data);
+
+	pthread_mutex_lock(&cache_lock);
+	while(1) {
+		e = cache_lookup(blocknum);
+		if(e && !e->loading) break;
+
+		//Someone else is reading the block in, or a ranged write is replacing it
+		if(e || cache_bypassed(blocknum)) {
+			pthread_cond_wait(&cache_idle,&cache_lock);
+			continue;
+		}
+
+		e = cache_victim();
+		if(!e) continue;
+
+		//The entry is hashed but loading, so the lock can go for the read
+		cache_insert(e,blocknum);
+		e->loading = 1;
+		pthread_mutex_unlock(&cache_lock);
+		disk_io(0,(off_t)blocknum*block_size,block_size,e->data);
+		pthread_mutex_lock(&cache_lock);
+		e->loading = 0;
+		nreads++;
+		memcpy(data,e->data,block_size);
+
+		//A discard or ranged write that dropped the block meanwhile left it unhashed
+		cache_push(&cache_clean,e,e->blocknum==blocknum);
+		pthread_cond_broadcast(&cache_idle);
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+
+	nhits++;
+	memcpy(data,e->data,block_size);
+	cache_touch(e);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+Read a block straight from the image, taking no locks and allocating
+nothing, so that a signal handler can call it. The caller has to know
+the cache holds nothing newer for the block, which disk_flush_blocks
+makes sure of. Returns 0 if the image could not be read.
+*/
+
+int disk_read_direct( int64_t blocknum, char *data )
+{
+	off_t offset = (off_t)blocknum*block_size;
+	off_t done = 0;
+
+	if(blocknum<0 || blocknum>=disk_size()) return 0;
+
+	while(done<block_size) {
+		int dev;
+		off_t devoffset = device_offset(offset+done,&dev);
+		off_t unitleft = stripe_unit-(offset+done)%stripe_unit;
+		size_t n = (block_size-done<unitleft) ? block_size-done : unitleft;
+		ssize_t actual = pread(devices[dev].fd,data+done,n,devoffset);
+
+		if(actual<0 && errno==EINTR) continue;
+		if(actual<=0) return 0;
+		done += actual;
+	}
+	return 1;
+}
+
+void disk_read_range( int64_t blocknum, int count, char *data )
+{
+	int i;
+
+	if(count<=0) return;
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+count-1,data);
+
+	//With writebacks held off, a block is either still cached or already on the image
+	pthread_mutex_lock(&flush_lock);
+	disk_io(0,(off_t)blocknum*block_size,(off_t)count*block_size,data);
+
+	//Cached blocks may be newer than the image
+	pthread_mutex_lock(&cache_lock);
+	nreads += count;
+	if(count<ncache) {
+		for(i=0;i<count;i++) {
+			struct disk_cache_entry *e = cache_lookup(blocknum+i);
+			if(e && !e->loading) memcpy(data+(off_t)i*block_size,e->data,block_size);
+		}
+	} else {
+		for(i=0;i<ncache;i++) {
+			struct disk_cache_entry *e = &cache[i];
+			if(e->blocknum>=blocknum && e->blocknum<blocknum+count && !e->loading) {
+				memcpy(data+(off_t)(e->blocknum-blocknum)*block_size,e->data,block_size);
+			}
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	pthread_mutex_unlock(&flush_lock);
+}
+
+static void cancel_discard( int64_t blocknum )
+{
+	int i = 0;
+
+	//A block freed twice is in two ranges, and every one of them has to give it up
+	while(i<npending) {
+		struct disk_range *r = &discards[i];
+		if(blocknum<r->start || blocknum>=r->start+r->count) {
+			i++;
+			continue;
+		}
+
+		if(blocknum==r->start) {
+			r->start++;
+			r->count--;
+		} else if(blocknum==r->start+r->count-1) {
+			r->count--;
+		} else {
+			//Splitting needs a free slot; without one the tail is just never punched
+			if(npending<DISK_DISCARD_RANGES) {
+				discards[npending].start = blocknum+1;
+				discards[npending].count = r->start+r->count-blocknum-1;
+				npending++;
+			}
+			r->count = blocknum-r->start;
+		}
+
+		if(!r->count) discards[i] = discards[--npending];
+		else i++;
+	}
+}
+
+void disk_write( int64_t blocknum, const char *data )
+{
+	struct disk_cache_entry *e;
+
+	sanity_check(blocknum,data);
+
+	pthread_mutex_lock(&cache_lock);
+
+	//A pending discard must not punch out the data written here
+	if(npending) cancel_discard(blocknum);
+
+	while(1) {
+		e = cache_lookup(blocknum);
+		if(e && e->loading) {
+			pthread_cond_wait(&cache_idle,&cache_lock);
+			continue;
+		}
+		if(e) break;
+
+		e = cache_victim();
+		if(!e) continue;
+		cache_insert(e,blocknum);
+		break;
+	}
+	memcpy(e->data,data,block_size);
+
+	if(!e->dirty) {
+		e->dirty = 1;
+		e->dirtied = now_ms();
+		ndirty++;
+	}
+
+	//A block being written back joins the dirty list when the writeback is done
+	if(!e->inflight) cache_push(&cache_dirty,e,1);
+	if(ndirty>=ncache*3/4 && !flusher_urgent) {
+		flusher_urgent = 1;
+		pthread_cond_signal(&flusher_wake);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+Start writing blocks around the cache. Their cached copies are dropped
+while no writeback is in flight, so nothing older can land on top of the
+new data, and reads that miss on them wait until bypass_end.
+*/
+
+static void bypass_begin( int64_t blocknum, int count )
+{
+	int i;
+
+	pthread_mutex_lock(&range_lock);
+	pthread_mutex_lock(&flush_lock);
+	pthread_mutex_lock(&cache_lock);
+	for(i=0;npending && i<count;i++) cancel_discard(blocknum+i);
+	cache_drop_range(blocknum,count);
+	cache_bypass.start = blocknum;
+	cache_bypass.count = count;
+	pthread_mutex_unlock(&cache_lock);
+	pthread_mutex_unlock(&flush_lock);
+}
+
+static void bypass_end( int written )
+{
+	pthread_mutex_lock(&cache_lock);
+	nwrites += written;
+	cache_bypass.count = 0;
+	pthread_cond_broadcast(&cache_idle);
+	pthread_mutex_unlock(&cache_lock);
+	pthread_mutex_unlock(&range_lock);
+}
+
+void disk_write_range( int64_t blocknum, int count, const char *data )
+{
+	if(count<=0) return;
+	sanity_check(blocknum,data);
+	sanity_check(blocknum+count-1,data);
+
+	bypass_begin(blocknum,count);
+	disk_io(1,(off_t)blocknum*block_size,(off_t)count*block_size,(char*)data);
+	bypass_end(count);
+}
+
+static int copy_unsupported( int err )
+{
+	return err==EXDEV || err==EINVAL || err==ENOSYS || err==EOPNOTSUPP || err==EBADF;
+}
+
+/*
+Copy length bytes between a host file and the image without bouncing
+them through user space. The host side is at *hostoffset, or at the
+file position when hostoffset is null. Returns 1 when the kernel did
+the whole copy and 0 if it cannot copy between these files at all.
+*/
+
+static int kernel_copy( int tohost, int fd, off_t *hostoffset, off_t offset, off_t length )
+{
+	off_t pos = offset;
+
+	while(pos<offset+length) {
+		int dev;
+		off_t devoffset = device_offset(pos,&dev);
+		off_t unitleft = stripe_unit-pos%stripe_unit;
+		size_t n = (offset+length-pos<unitleft) ? offset+length-pos : unitleft;
+		ssize_t actual;
+
+		if(tohost) actual = copy_file_range(devices[dev].fd,&devoffset,fd,hostoffset,n,0);
+		else actual = copy_file_range(fd,hostoffset,devices[dev].fd,&devoffset,n,0);
+
+		if(actual<0 && errno==EINTR) continue;
+		if(actual<0 && pos==offset && copy_unsupported(errno)) return 0;
+		if(actual<=0) {
+			printf("ERROR: couldn't copy %s simulated disk: %s\n",tohost ? "from" : "to",strerror(errno));
+			return -1;
+		}
+		pos += actual;
+	}
+
+	return 1;
+}
+
+static int copy_in( int fd, off_t hostoffset, off_t offset, off_t length )
+{
+	int result = kernel_copy(0,fd,&hostoffset,offset,length);
+	if(result<0) return 0;
+
+	//Fall back to bouncing large chunks through memory
+	if(!result) {
+		char *buffer = malloc(DISK_COPY_CHUNK);
+		off_t done = 0;
+		if(!buffer) return 0;
+
+		while(done<length) {
+			off_t n = (length-done<DISK_COPY_CHUNK) ? length-done : DISK_COPY_CHUNK;
+			ssize_t actual = pread(fd,buffer,n,hostoffset+done);
+			if(actual<0 && errno==EINTR) continue;
+			if(actual!=n) {
+				free(buffer);
+				return 0;
+			}
+			disk_io(1,offset+done,n,buffer);
+			done += n;
+		}
+		free(buffer);
+	}
+
+	return 1;
+}
+
+static int copy_out( int fd, off_t offset, off_t length )
+{
+	int result = kernel_copy(1,fd,0,offset,length);
+	if(result<0) return 0;
+
+	//Pipes and terminals cannot take a kernel copy, so stream through memory
+	if(!result) {
+		char *buffer = malloc(DISK_COPY_CHUNK);
+		off_t done = 0;
+		if(!buffer) return 0;
+
+		while(done<length) {
+			off_t n = (length-done<DISK_COPY_CHUNK) ? length-done : DISK_COPY_CHUNK;
+			disk_io(0,offset+done,n,buffer);
+
+			off_t written = 0;
+			while(written<n) {
+				ssize_t actual = write(fd,buffer+written,n-written);
+				if(actual<0 && errno==EINTR) continue;
+				if(actual<=0) {
+					free(buffer);
+					return 0;
+				}
+				written += actual;
+			}
+			done += n;
+		}
+		free(buffer);
+	}
+
+	return 1;
+}
+
+int disk_copy_from_fd( int fd, off_t hostoffset, int64_t blocknum, int count )
+{
+	int ok;
+
+	if(count<=0) return 1;
+	sanity_check(blocknum,discards);
+	sanity_check(blocknum+count-1,discards);
+
+	//Like disk_write_range, the copy replaces whatever is cached for these blocks
+	bypass_begin(blocknum,count);
+	ok = copy_in(fd,hostoffset,(off_t)blocknum*block_size,(off_t)count*block_size);
+	bypass_end(ok ? count : 0);
+
+	return ok;
+}
+
+int disk_copy_to_fd( int64_t blocknum, int count, int fd, off_t length )
+{
+	struct disk_range range = { blocknum, count };
+	int ok;
+
+	if(count<=0) return 1;
+	sanity_check(blocknum,discards);
+	sanity_check(blocknum+count-1,discards);
+
+	if(length>(off_t)count*block_size) length = (off_t)count*block_size;
+
+	//The kernel copies straight from the image, so dirty blocks have to be there first
+	pthread_mutex_lock(&flush_lock);
+	cache_writeback(pick_range,&range);
+	ok = copy_out(fd,(off_t)blocknum*block_size,length);
+	pthread_mutex_unlock(&flush_lock);
+
+	pthread_mutex_lock(&cache_lock);
+	if(ok) nreads += count;
+	pthread_mutex_unlock(&cache_lock);
+
+	return ok;
+}
+
+void disk_discard( int64_t blocknum, int64_t count )
+{
+	int i;
+
+	if(count<=0) return;
+	sanity_check(blocknum,discards);
+	sanity_check(blocknum+count-1,discards);
+
+	pthread_mutex_lock(&cache_lock);
+
+	//Whatever is cached for freed blocks never needs to reach the disk
+	cache_drop_range(blocknum,count);
+
+	//Extend an adjacent pending range if there is one
+	for(i=0;i<npending;i++) {
+		struct disk_range *r = &discards[i];
+		if(r->start+r->count==blocknum) {
+			r->count += count;
+			break;
+		}
+		if(blocknum+count==r->start) {
+			r->start = blocknum;
+			r->count += count;
+			break;
+		}
+	}
+
+	if(i==npending) {
+		while(npending==DISK_DISCARD_RANGES) {
+			pthread_mutex_unlock(&cache_lock);
+			disk_discard_flush();
+			pthread_mutex_lock(&cache_lock);
+		}
+		discards[npending].start = blocknum;
+		discards[npending].count = count;
+		npending++;
+	}
+
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static int compare_ranges( const void *pa, const void *pb )
+{
+	const struct disk_range *a = pa;
+	const struct disk_range *b = pb;
+	return (a->start > b->start) - (a->start < b->start);
+}
+
+static int punch_range( off_t offset, off_t length )
+{
+	off_t nsegments = (offset+length-1)/stripe_unit - offset/stripe_unit + 1;
+	struct iovec *iov = malloc(nsegments*sizeof(struct iovec));
+	struct disk_job jobs[DISK_MAX_DEVICES];
+	int d, ok = 1;
+
+	if(!iov) return 0;
+	split_range(offset,length,0,iov,jobs);
+
+	//Discard is only a hint, so an unsupporting host filesystem is not an error
+	for(d=0;d<ndevices;d++) {
+		if(!jobs[d].iovcnt) continue;
+		if(fallocate(devices[d].fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,jobs[d].offset,jobs[d].length)<0) ok = 0;
+	}
+
+	free(iov);
+	return ok;
+}
+
+//Punch out the pending discards; the caller holds flush_lock so no writeback races the punch
+static void discard_flush()
+{
+	struct disk_range ranges[DISK_DISCARD_RANGES];
+	int i, n;
+	int64_t punched = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	n = npending;
+	memcpy(ranges,discards,n*sizeof(ranges[0]));
+	npending = 0;
+	pthread_mutex_unlock(&cache_lock);
+
+	if(!n) return;
+
+	qsort(ranges,n,sizeof(ranges[0]),compare_ranges);
+
+	i = 0;
+	while(i<n) {
+		int64_t start = ranges[i].start;
+		int64_t end = start+ranges[i].count;
+
+		//Coalesce ranges that ended up touching each other
+		for(i++;i<n && ranges[i].start<=end;i++) {
+			int64_t e = ranges[i].start+ranges[i].count;
+			if(e>end) end = e;
+		}
+
+		if(punch_range((off_t)start*block_size,(off_t)(end-start)*block_size)) {
+			punched += end-start;
+		}
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	ndiscards += punched;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+Take blocks back out of the pending discards. Writing a block does this by
+itself; this is for blocks put to use without being written, such as ones
+reserved for a file, so that freeing them again cannot queue them twice.
+*/
+
+void disk_discard_cancel( int64_t blocknum, int64_t count )
+{
+	int64_t i;
+
+	pthread_mutex_lock(&cache_lock);
+	for(i=0;npending && i<count;i++) cancel_discard(blocknum+i);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void disk_discard_flush()
+{
+	pthread_mutex_lock(&flush_lock);
+	discard_flush();
+	pthread_mutex_unlock(&flush_lock);
+}
+
+static int sync_devices()
+{
+	int i, ok = 1;
+
+	for(i=0;i<ndevices;i++) {
+		if(fdatasync(devices[i].fd)<0) ok = 0;
+	}
+	return ok;
+}
+
+int disk_sync()
+{
+	pthread_mutex_lock(&flush_lock);
+	cache_writeback(pick_all,0);
+	discard_flush();
+	pthread_mutex_unlock(&flush_lock);
+
+	return sync_devices();
+}
+
+int disk_flush_blocks( const int64_t *blocks, int count )
+{
+	struct disk_block_list list;
+	int64_t *sorted = malloc((count>0 ? count : 1)*sizeof(int64_t));
+
+	if(!sorted) return 0;
+	memcpy(sorted,blocks,count*sizeof(int64_t));
+	qsort(sorted,count,sizeof(int64_t),compare_blocks);
+	list.blocks = sorted;
+	list.count = count;
+
+	//Written back but not synced: the image has them, though the host may not have them on media yet
+	pthread_mutex_lock(&flush_lock);
+	cache_writeback(pick_list,&list);
+	pthread_mutex_unlock(&flush_lock);
+	free(sorted);
+
+	return 1;
+}
+
+int disk_sync_blocks( const int64_t *blocks, int count )
+{
+	if(!disk_flush_blocks(blocks,count)) return 0;
+	return sync_devices();
+}
+
+void disk_close()
+{
+	int i;
+
+	if(ndevices) {
+		pthread_mutex_lock(&cache_lock);
+		flusher_stop = 1;
+		pthread_cond_signal(&flusher_wake);
+		pthread_mutex_unlock(&cache_lock);
+		pthread_join(flusher,0);
+
+		pthread_mutex_lock(&flush_lock);
+		cache_writeback(pick_all,0);
+		discard_flush();
+		pthread_mutex_unlock(&flush_lock);
+
+		printf("%lld disk block reads\n",(long long)nreads);
+		printf("%lld disk block writes\n",(long long)nwrites);
+		printf("%lld disk block discards\n",(long long)ndiscards);
+		printf("%lld disk cache hits\n",(long long)nhits);
+
+		for(i=0;i<ndevices;i++) {
+			struct disk_device *d = &devices[i];
+			if(ndevices>1) {
+				pthread_mutex_lock(&d->lock);
+				d->stop = 1;
+				pthread_cond_signal(&d->ready);
+				pthread_mutex_unlock(&d->lock);
+				pthread_join(d->thread,0);
+			}
+			close(d->fd);
+		}
+		ndevices = 0;
+
+		pthread_cond_destroy(&flusher_wake);
+		free(cache);
+		free(cache_hash);
+		free(cache_batch);
+		free(cache_data);
+		free(cache_staging);
+	}
+}
@@ -1,13 +1,34 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <sys/types.h>
+#include <stdint.h>
+
 #define DISK_BLOCK_SIZE 4096
+#define DISK_MAX_BLOCK_SIZE 65536
+#define DISK_MAX_DEVICES 16
+#define DISK_STRIPE_UNIT 65536
 
-int  disk_init( const char *filename, int nblocks );
-int  disk_size();
-void disk_read( int blocknum, char *data );
-void disk_write( int blocknum, const char *data );
+int  disk_init( const char *filename, int64_t nblocks );
+int  disk_init_striped( const char **filenames, int ndevices, int64_t nblocks, int stripe_unit );
+int  disk_set_block_size( int size );
+int  disk_block_size();
+int  disk_devices();
+int64_t disk_size();
+void disk_read( int64_t blocknum, char *data );
+int  disk_read_direct( int64_t blocknum, char *data );
+void disk_write( int64_t blocknum, const char *data );
+void disk_read_range( int64_t blocknum, int count, char *data );
+void disk_write_range( int64_t blocknum, int count, const char *data );
+int  disk_copy_from_fd( int fd, off_t hostoffset, int64_t blocknum, int count );
+int  disk_copy_to_fd( int64_t blocknum, int count, int fd, off_t length );
+void disk_discard( int64_t blocknum, int64_t count );
+void disk_discard_cancel( int64_t blocknum, int64_t count );
+void disk_discard_flush();
+int  disk_sync();
+int  disk_sync_blocks( const int64_t *blocks, int count );
+int  disk_flush_blocks( const int64_t *blocks, int count );
 void disk_close();
 
 
-#endif
\ No newline at end of file
+#endif
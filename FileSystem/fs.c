@@ -4,141 +4,654 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
 
-#define DISK_BLOCK_SIZE	   4096
 #define FS_MAGIC           0xf0f03410
-#define INODES_PER_BLOCK   128
+#define FS_MAGIC64         0xf0f06410
 #define POINTERS_PER_INODE 5
-#define POINTERS_PER_BLOCK 1024
+#define FS_BLOCKS_PER_GROUP 8192
+#define FS_DEFRAG_BATCH    (4 << 20)	//bytes copied per I/O when defragmenting
+
+//Revision 1 inodes trade two direct pointers for double and triple indirect blocks
+#define FS_REVISION        1
+#define FS_DIRECT64        3
+#define FS_INDIRECT_LEVELS 3
+
+//Preallocated blocks carry this bit in their pointer until data is written to them
+#define FS_UNWRITTEN       ((int64_t)1 << 62)
+#define FS_UNWRITTEN32     0x40000000
+#define BLOCKNUM(p)        ((p) & ~FS_UNWRITTEN)
+#define WRITTEN(p)         (((p) & FS_UNWRITTEN) ? 0 : (p))
 
 int fs_mounted = 0;
-int *free_bitmap;
-int in_blocks;
+unsigned char *free_bitmap;
+
+//Geometry of the mounted image, fixed in the superblock at format time
+int revision;
+int block_size = DISK_BLOCK_SIZE;
+int block_shift = 12;
+int inodes_per_block;
+int pointers_per_block;
+int direct_pointers;
+int indirect_levels;
+
+struct fs_group_desc {
+	int inode_table;	//first inode block of the group
+	int itable_unused;	//inode blocks at the end of the group's slice not yet initialized
+};
+
+//The superblock has to fit in the smallest block size
+#define FS_MAX_GROUPS ((DISK_BLOCK_SIZE - 9*sizeof(int)) / sizeof(struct fs_group_desc))
 
+//Revision 0: block numbers and sizes are 32 bits
 struct fs_superblock {
 	int magic;
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	int itable_unused;	//ungrouped images: inode blocks at the end of the table not yet initialized
+	int ngroups;		//0 for images made before block groups
+	int blocks_per_group;
+	int inodeblocks_per_group;
+	int block_size;		//0 for images made before the block size was configurable
+	struct fs_group_desc groups[FS_MAX_GROUPS];
 };
 
-struct fs_inode {
+struct fs_group_desc64 {
+	int64_t inode_table;
+	int64_t itable_unused;
+};
+
+#define FS_MAX_GROUPS64 ((DISK_BLOCK_SIZE - 4*sizeof(int) - 5*sizeof(int64_t)) / sizeof(struct fs_group_desc64))
+
+//Revision 1: 64-bit block numbers and sizes, under a magic older code does not recognize
+struct fs_superblock64 {
+	int magic;
+	int revision;
+	int block_size;
+	int ngroups;
+	int64_t nblocks;
+	int64_t ninodeblocks;
+	int64_t ninodes;
+	int64_t blocks_per_group;
+	int64_t inodeblocks_per_group;
+	struct fs_group_desc64 groups[FS_MAX_GROUPS64];
+};
+
+struct fs_inode32 {
 	int isvalid;
 	int size;
 	int direct[POINTERS_PER_INODE];
 	int indirect;
 };
 
+struct fs_inode64 {
+	int isvalid;
+	int unused;
+	int64_t size;
+	int64_t direct[FS_DIRECT64];
+	int64_t indirect[FS_INDIRECT_LEVELS];	//single, double and triple indirect blocks
+};
+
+//An inode as the rest of the code sees it, whichever revision it was read from
+struct fs_inode {
+	int isvalid;
+	off_t size;
+	int64_t direct[POINTERS_PER_INODE];
+	int64_t indirect[FS_INDIRECT_LEVELS];
+};
+
+//Sized for the largest block; only the first block_size bytes are used
 union fs_block {
 	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
-	int pointers[POINTERS_PER_BLOCK];
-	char data[DISK_BLOCK_SIZE];
+	struct fs_superblock64 super64;
+	struct fs_inode32 inode32[DISK_MAX_BLOCK_SIZE / sizeof(struct fs_inode32)];
+	struct fs_inode64 inode64[DISK_MAX_BLOCK_SIZE / sizeof(struct fs_inode64)];
+	int pointers32[DISK_MAX_BLOCK_SIZE / sizeof(int)];
+	int64_t pointers64[DISK_MAX_BLOCK_SIZE / sizeof(int64_t)];
+	char data[DISK_MAX_BLOCK_SIZE];
+};
+
+//In-memory state of a block group
+struct fs_group {
+	int64_t start;		//first block of the group
+	int64_t end;		//one past the last block of the group
+	int64_t data;		//first block that may hold data
+	int64_t inode_table;
+	int64_t itable_unused;
+	int64_t nfree;		//free data blocks
+	int nfreeinodes;
 };
 
-int calcInodeBlocks(){
-	int inode_blocks = disk_size() / 10;
+struct fs_group *groups;
+int ngroups;
+int grouped;
+int64_t fs_nblocks;
+int64_t blocks_per_group;
+int64_t inodeblocks_per_group;
+
+//Mapped views of files and decoded block maps, kept in step with calls that change files
+void mmapInvalidate(int inumber, off_t offset, off_t length);
+void mmapRemap(int inumber);
+void blockMapInvalidate(int inumber);
+
+void setRevision(int rev){
+//Inode and pointer sizes, and so the per-block counts, depend on the revision
+	revision = rev;
+	inodes_per_block = block_size / (rev ? sizeof(struct fs_inode64) : sizeof(struct fs_inode32));
+	pointers_per_block = block_size / (rev ? sizeof(int64_t) : sizeof(int));
+	direct_pointers = rev ? FS_DIRECT64 : POINTERS_PER_INODE;
+	indirect_levels = rev ? FS_INDIRECT_LEVELS : 1;
+}
+
+int setBlockSize(int size){
+//Switch the disk and the per-block counts derived from it over to a new block size
+	if(!disk_set_block_size(size)) return 0;
+
+	block_size = size;
+	for(block_shift = 0; (1 << block_shift) < size; block_shift++);
+	setRevision(revision);
+	return 1;
+}
+
+static inline int64_t from32(int p){
+	return (p & FS_UNWRITTEN32) ? (int64_t)(p & ~FS_UNWRITTEN32) | FS_UNWRITTEN : p;
+}
+
+static inline int to32(int64_t p){
+	return (p & FS_UNWRITTEN) ? (int)BLOCKNUM(p) | FS_UNWRITTEN32 : (int)p;
+}
+
+static inline int64_t getPointer(const union fs_block *block, int i){
+	return revision ? block->pointers64[i] : from32(block->pointers32[i]);
+}
+
+static inline void setPointer(union fs_block *block, int i, int64_t p){
+	if(revision) block->pointers64[i] = p;
+	else block->pointers32[i] = to32(p);
+}
+
+void getInode(const union fs_block *block, int index, struct fs_inode *inode){
+//Unpack an inode of the current revision
+	int i;
+	memset(inode, 0, sizeof(*inode));
+
+	if(revision){
+		const struct fs_inode64 *d = &block->inode64[index];
+		inode->isvalid = d->isvalid;
+		inode->size = d->size;
+		for(i = 0; i < FS_DIRECT64; i++) inode->direct[i] = d->direct[i];
+		for(i = 0; i < FS_INDIRECT_LEVELS; i++) inode->indirect[i] = d->indirect[i];
+	}
+	else {
+		const struct fs_inode32 *d = &block->inode32[index];
+		inode->isvalid = d->isvalid;
+		inode->size = d->size;
+		for(i = 0; i < POINTERS_PER_INODE; i++) inode->direct[i] = from32(d->direct[i]);
+		inode->indirect[0] = d->indirect;
+	}
+}
+
+void putInode(union fs_block *block, int index, const struct fs_inode *inode){
+	int i;
+
+	if(revision){
+		struct fs_inode64 *d = &block->inode64[index];
+		memset(d, 0, sizeof(*d));
+		d->isvalid = inode->isvalid;
+		d->size = inode->size;
+		for(i = 0; i < FS_DIRECT64; i++) d->direct[i] = inode->direct[i];
+		for(i = 0; i < FS_INDIRECT_LEVELS; i++) d->indirect[i] = inode->indirect[i];
+	}
+	else {
+		struct fs_inode32 *d = &block->inode32[index];
+		d->isvalid = inode->isvalid;
+		d->size = inode->size;
+		for(i = 0; i < POINTERS_PER_INODE; i++) d->direct[i] = to32(inode->direct[i]);
+		d->indirect = inode->indirect[0];
+	}
+}
+
+int64_t calcInodeBlocks(){
+	int64_t inode_blocks = disk_size() / 10;
 	inode_blocks += (disk_size() % 10 == 0) ? 0 : 1;
 	return inode_blocks;
 }
 
-void updateBitmap() {
-	
+int loadGroups(union fs_block *block){
+//Build the in-memory group table from the superblock
+	int g, n;
+	struct fs_group *table;
+
+	if(revision){
+		struct fs_superblock64 *super = &block->super64;
+		n = super->ngroups;
+		if(n < 1 || n > FS_MAX_GROUPS64 || super->blocks_per_group <= 0) return 0;
+		if(!(table = calloc(n, sizeof(struct fs_group)))) return 0;
+
+		fs_nblocks = super->nblocks;
+		blocks_per_group = super->blocks_per_group;
+		inodeblocks_per_group = super->inodeblocks_per_group;
+		for(g=0; g<n; g++){
+			table[g].start = g*blocks_per_group;
+			table[g].end = (g == n-1) ? super->nblocks : (g+1)*blocks_per_group;
+			table[g].inode_table = super->groups[g].inode_table;
+			table[g].itable_unused = super->groups[g].itable_unused;
+		}
+	}
+	else if(!block->super.ngroups){
+		//Images made before block groups are a single group with the table after the superblock
+		struct fs_superblock *super = &block->super;
+		n = 1;
+		if(!(table = calloc(n, sizeof(struct fs_group)))) return 0;
+
+		fs_nblocks = super->nblocks;
+		blocks_per_group = super->nblocks;
+		inodeblocks_per_group = super->ninodeblocks;
+		table[0].start = 0;
+		table[0].end = super->nblocks;
+		table[0].inode_table = 1;
+		table[0].itable_unused = super->itable_unused;
+	}
+	else {
+		struct fs_superblock *super = &block->super;
+		n = super->ngroups;
+		if(n < 0 || n > FS_MAX_GROUPS || super->blocks_per_group <= 0) return 0;
+		if(!(table = calloc(n, sizeof(struct fs_group)))) return 0;
+
+		fs_nblocks = super->nblocks;
+		blocks_per_group = super->blocks_per_group;
+		inodeblocks_per_group = super->inodeblocks_per_group;
+		for(g=0; g<n; g++){
+			table[g].start = g*blocks_per_group;
+			table[g].end = (g == n-1) ? super->nblocks : (g+1)*blocks_per_group;
+			table[g].inode_table = super->groups[g].inode_table;
+			table[g].itable_unused = super->groups[g].itable_unused;
+		}
+	}
+
+	//Inode numbers are ints
+	int ok = (int64_t)n*inodeblocks_per_group*inodes_per_block <= INT_MAX;
+	for(g=0; g<n; g++){
+		if(table[g].itable_unused < 0 || table[g].itable_unused > inodeblocks_per_group ||
+		   table[g].inode_table <= 0 || table[g].inode_table + inodeblocks_per_group > fs_nblocks) ok = 0;
+
+		//Older layouts keep the table inside its own group
+		if(!revision && table[g].inode_table + inodeblocks_per_group > table[g].end) ok = 0;
+
+		//Data follows a table at the front of its group; a table moved elsewhere is just reserved space
+		table[g].data = table[g].start ? table[g].start : 1;
+		if(table[g].inode_table == table[g].data) table[g].data += inodeblocks_per_group;
+	}
+	if(!ok){
+		free(table);
+		return 0;
+	}
+
+	free(groups);
+	groups = table;
+	ngroups = n;
+	grouped = revision || block->super.ngroups;
+	return 1;
+}
+
+int loadSuperblock(union fs_block *block){
+//Read the superblock and take on the image's revision, block size and group layout
+	int size;
+	int64_t nblocks;
+
+	disk_read(0, block->data);
+	if(block->super.magic == FS_MAGIC){
+		revision = 0;
+		size = block->super.block_size ? block->super.block_size : DISK_BLOCK_SIZE;
+		nblocks = block->super.nblocks;
+	}
+	else if(block->super64.magic == FS_MAGIC64 && block->super64.revision == FS_REVISION){
+		revision = FS_REVISION;
+		size = block->super64.block_size;
+		nblocks = block->super64.nblocks;
+	}
+	else return 0;
+
+	if(!setBlockSize(size)) return 0;
+	if(nblocks > disk_size()) return 0;
+	return loadGroups(block);
+}
+
+int blockGroup(int64_t blocknum){
+	int64_t g = blocknum / blocks_per_group;
+	return (g < ngroups) ? g : ngroups-1;
+}
+
+int64_t dataStart(int g){
+	return groups[g].data;
+}
+
+int64_t tableEnd(int g){
+	return groups[g].inode_table + inodeblocks_per_group;
+}
+
+int inodeLocation(int inumber, int *group, int64_t *blocknum){
+//Translate an inode number to its group and inode block, returning the index in that block
+	int64_t per_group = inodeblocks_per_group*inodes_per_block;
+	if(inumber < 1 || inumber >= ngroups*per_group) return -1;
+
+	*group = inumber / per_group;
+	*blocknum = groups[*group].inode_table + (inumber % per_group) / inodes_per_block;
+	return inumber % inodes_per_block;
+}
+
+int inodeNumber(int g, int64_t blocknum, int index){
+	return g*inodeblocks_per_group*inodes_per_block + (blocknum - groups[g].inode_table)*inodes_per_block + index;
+}
+
+int inodeBlockInitialized(int g, int64_t blocknum){
+	return blocknum < tableEnd(g) - groups[g].itable_unused;
+}
+
+static inline void markPointersN(const union fs_block *block, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		int64_t p = getPointer(block, i);
+		if (p) free_bitmap[BLOCKNUM(p)] = 1;
+	}
+}
+
+void markPointers(const union fs_block *block) {
+//Claim every block named in an indirect block; constant counts let the common sizes unroll
+	switch (pointers_per_block) {
+		case 512:   markPointersN(block, 512);   break;
+		case 1024:  markPointersN(block, 1024);  break;
+		case 2048:  markPointersN(block, 2048);  break;
+		case 4096:  markPointersN(block, 4096);  break;
+		case 8192:  markPointersN(block, 8192);  break;
+		case 16384: markPointersN(block, 16384); break;
+		default:    markPointersN(block, pointers_per_block); break;
+	}
+}
+
+void markTree(int64_t blocknum, int depth) {
+//Claim a pointer block and everything below it; at depth 1 it points straight at data
 	union fs_block block;
-	union fs_block ind_block;
+	int i;
+
+	free_bitmap[blocknum] = 1;
+	disk_read(blocknum, block.data);
+	if (depth == 1) {
+		markPointers(&block);
+		return;
+	}
+	for (i = 0; i < pointers_per_block; i++) {
+		int64_t p = getPointer(&block, i);
+		if (p) markTree(p, depth-1);
+	}
+}
+
+void scanGroup(int g) {
+//Mark the blocks used by every inode stored in this group
+	union fs_block block;
+	struct fs_inode inode;
 
-	int i, j, k, m;
+	int j, k, nvalid = 0;
+	int64_t i;
+	struct fs_group *grp = &groups[g];
+
+	//The whole table is reserved, whether or not its blocks hold inodes yet
+	for (i = grp->inode_table; i < tableEnd(g); i++) free_bitmap[i] = 1;
+
+	for (i = grp->inode_table; inodeBlockInitialized(g, i); i++) {
 
-	for (i = 0; i < disk_size(); i++) {
-		
 		disk_read(i, block.data);
 
-		if (!i) {//superblock
-			free_bitmap[0] = (block.super.magic == FS_MAGIC) ? 1 : 0;
-		}
-		else if (i <= in_blocks) {//inode blocks
-
-			//Check each inode
-			int foundValid = 0;
-			for (j = 0; j < INODES_PER_BLOCK; j++) {
-
-				if (block.inode[j].isvalid) {
-
-					//The entire block is valid
-					free_bitmap[i] = 1;
-					foundValid = 1;
-					//Check the address of the direct poointers
-					for (k = 0; k < POINTERS_PER_INODE; k++) {
-
-						if(block.inode[j].direct[k]) free_bitmap[block.inode[j].direct[k]] = 1;
-						//free_bitmap[block.inode[j].direct[k]] = (block.inode[j].direct[k]) ? 1 : 0;
-					}
-					
-					//Check the indirect pointer
-					if (block.inode[j].indirect) {
-						//Follow the pointer to the indirect block and search it
-						disk_read(block.inode[j].indirect, ind_block.data);
-						for (m = 0; m < POINTERS_PER_BLOCK; m++) {
-							if(ind_block.pointers[m]) free_bitmap[ind_block.pointers[m]] = 1;
-							//free_bitmap[ind_block.pointers[m]] = (ind_block.pointers[m]) ? 1 : 0;
-						}
-					}
+		//Check each inode
+		for (j = 0; j < inodes_per_block; j++) {
 
-				}
+			getInode(&block, j, &inode);
+			if (!inode.isvalid) continue;
+			nvalid++;
+
+			//Check the address of the direct poointers
+			for (k = 0; k < direct_pointers; k++) {
+
+				if(inode.direct[k]) free_bitmap[BLOCKNUM(inode.direct[k])] = 1;
+			}
+
+			//Follow each level of indirect blocks and search them
+			for (k = 0; k < indirect_levels; k++) {
+				if (inode.indirect[k]) markTree(inode.indirect[k], k+1);
 			}
+		}
+	}
+
+	//inode 0 is never handed out
+	grp->nfreeinodes = inodeblocks_per_group*inodes_per_block - nvalid - (g ? 0 : 1);
+}
+
+void updateBitmap() {
+
+	int g;
+	int64_t i;
+
+	//The superblock
+	free_bitmap[0] = 1;
+
+	for (g = 0; g < ngroups; g++) scanGroup(g);
+
+	//Free counts are only known once every group has claimed its blocks
+	for (g = 0; g < ngroups; g++) {
+		groups[g].nfree = 0;
+		for (i = dataStart(g); i < groups[g].end; i++) {
+			if (!free_bitmap[i]) groups[g].nfree++;
+		}
+	}
+
+}
+
+void freeBlock(int64_t blocknum){
+//Release a block and let the disk punch it out of the image
+	free_bitmap[blocknum] = 0;
+	groups[blockGroup(blocknum)].nfree++;
+	disk_discard(blocknum, 1);
+}
+
+static inline void freePointersN(const union fs_block *block, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		int64_t p = getPointer(block, i);
+		if (p) freeBlock(BLOCKNUM(p));
+	}
+}
+
+void freePointers(const union fs_block *block) {
+//Release every block named in an indirect block, specialized like markPointers
+	switch (pointers_per_block) {
+		case 512:   freePointersN(block, 512);   break;
+		case 1024:  freePointersN(block, 1024);  break;
+		case 2048:  freePointersN(block, 2048);  break;
+		case 4096:  freePointersN(block, 4096);  break;
+		case 8192:  freePointersN(block, 8192);  break;
+		case 16384: freePointersN(block, 16384); break;
+		default:    freePointersN(block, pointers_per_block); break;
+	}
+}
+
+void freeTree(int64_t blocknum, int depth){
+//Release a pointer block and everything below it
+	union fs_block block;
+	int i;
 
-			if(!foundValid) free_bitmap[i] = 0;
+	disk_read(blocknum, block.data);
+	if(depth == 1) freePointers(&block);
+	else {
+		for(i = 0; i < pointers_per_block; i++){
+			int64_t p = getPointer(&block, i);
+			if(p) freeTree(p, depth-1);
 		}
 	}
+	freeBlock(blocknum);
+}
+
+int64_t levelSpan(int depth){
+//Logical blocks covered by one pointer in a pointer block at this depth
+	int64_t span = 1;
+	while(--depth > 0) span *= pointers_per_block;
+	return span;
+}
 
+int64_t pointerBlocks(int64_t nblocks){
+//Pointer blocks needed to map logical blocks 0..nblocks-1
+	int64_t total = 0, left = nblocks - direct_pointers;
+	int d, k;
+
+	for(d = 1; d <= indirect_levels && left > 0; d++){
+		int64_t n = (left < levelSpan(d+1)) ? left : levelSpan(d+1);
+		for(k = 1; k <= d; k++){
+			int64_t span = levelSpan(d-k+2);	//data blocks under one pointer block at level k
+			total += (n + span - 1) / span;
+		}
+		left -= n;
+	}
+	return total;
 }
 
-void invalidateInodes(int inodeBlocks){
-//Invalidate all inodes in the inode blocks
+int truncateTree(int64_t blocknum, int depth, int64_t base, int64_t keep){
+//Free what a pointer block maps at or past logical block keep; base is the first block it maps.
+//Returns 1 once nothing is left under it and the block itself is freed.
+	if(base >= keep){
+		freeTree(blocknum, depth);
+		return 1;
+	}
+
 	union fs_block block;
+	int i, left = 0, dirty = 0;
+	int64_t span = levelSpan(depth);
+
+	disk_read(blocknum, block.data);
+	for(i = 0; i < pointers_per_block; i++){
+		int64_t p = getPointer(&block, i), first = base + i*span;
+		if(!p) continue;
+		if(first + span <= keep){
+			left = 1;
+			continue;
+		}
 
-	int i,j;
-	for(i=1; i<=inodeBlocks; i++){
-		disk_read(i,block.data);
-		for(j=0;j<INODES_PER_BLOCK;j++){
-			block.inode[j].isvalid = 0;
+		if(depth == 1) freeBlock(BLOCKNUM(p));
+		else if(!truncateTree(p, depth-1, first, keep)){
+			left = 1;
+			continue;
 		}
+		setPointer(&block, i, 0);
+		dirty = 1;
+	}
+
+	if(!left){
+		freeBlock(blocknum);
+		return 1;
+	}
+	if(dirty) disk_write(blocknum, block.data);
+	return 0;
+}
+
+void truncateBlocks(struct fs_inode *inode, int64_t keep){
+//Free every block of the file from logical block keep on, in one pass over its tree
+	int64_t i, base = direct_pointers;
+	int d;
+
+	for(i=keep; i<direct_pointers; i++){
+		if(!inode->direct[i]) continue;
+		freeBlock(BLOCKNUM(inode->direct[i]));
+		inode->direct[i] = 0;
+	}
+
+	for(d=1; d<=indirect_levels; d++){
+		if(inode->indirect[d-1] && truncateTree(inode->indirect[d-1], d, base, keep)) inode->indirect[d-1] = 0;
+		base += levelSpan(d+1);
+	}
+}
+
+void invalidateInodes(int64_t first, int64_t last){
+//Write out empty inode blocks for the given range of the inode table
+	union fs_block block;
+	memset(block.data, 0, block_size);
+
+	int64_t i;
+	for(i=first; i<=last; i++){
 		disk_write(i,block.data);
 	}
 }
 
-void dispInode(struct fs_inode *myInode, int inodeBlock, int offset) {
+void readInodeBlock(int g, int64_t blocknum, union fs_block *block){
+//Blocks past the initialized part of the group's slice read as empty inodes
+	if(inodeBlockInitialized(g, blocknum)) disk_read(blocknum, block->data);
+	else memset(block->data, 0, block_size);
+}
+
+void writeInodeBlock(int g, int64_t blocknum, union fs_block *block){
+	if(inodeBlockInitialized(g, blocknum)){
+		disk_write(blocknum, block->data);
+		return;
+	}
+
+	//Zero the uninitialized blocks in front of this one so the slice stays a prefix
+	invalidateInodes(tableEnd(g) - groups[g].itable_unused, blocknum - 1);
+	disk_write(blocknum, block->data);
+
+	//Only move the mark once the blocks behind it are on disk
+	union fs_block super;
+	disk_read(0, super.data);
+	groups[g].itable_unused = tableEnd(g) - blocknum - 1;
+	if(revision) super.super64.groups[g].itable_unused = groups[g].itable_unused;
+	else if(grouped) super.super.groups[g].itable_unused = groups[g].itable_unused;
+	else super.super.itable_unused = groups[g].itable_unused;
+	disk_write(0, super.data);
+}
+
+void dispTree(int64_t blocknum, int depth) {
+//Print the data blocks under a pointer block
+	union fs_block block;
+	int i;
+
+	disk_read(blocknum, block.data);
+	for (i = 0; i < pointers_per_block; i++) {
+		int64_t p = getPointer(&block, i);
+		if (!p) continue;
+		if (depth > 1) dispTree(p, depth-1);
+		else printf(" %lld%s", (long long)BLOCKNUM(p), WRITTEN(p) ? "" : "u");
+	}
+}
+
+void dispInode(struct fs_inode *myInode, int inumber) {
 
+	static const char *levels[FS_INDIRECT_LEVELS] = { "", "double ", "triple " };
 	int i, dcount=0;
-	printf("inode %d:\n", (inodeBlock - 1)*INODES_PER_BLOCK + offset);
-	printf("    size: %d bytes\n", myInode->size);
-	
-	for (i = 0; i < POINTERS_PER_INODE; i++) {
+	printf("inode %d:\n", inumber);
+	printf("    size: %lld bytes\n", (long long)myInode->size);
+
+	for (i = 0; i < direct_pointers; i++) {
 
 		if (myInode->direct[i]) {
 			dcount += 1;
 			if (dcount == 1) printf("    direct blocks:");
-			printf(" %d", myInode->direct[i]);
+			printf(" %lld%s", (long long)BLOCKNUM(myInode->direct[i]), WRITTEN(myInode->direct[i]) ? "" : "u");
 		}
 
-		if (i == POINTERS_PER_INODE - 1  && dcount) printf("\n");
+		if (i == direct_pointers - 1  && dcount) printf("\n");
 
 	}
 
-	if (myInode->indirect) {
-		printf("    indirect block: %d\n", myInode->indirect);
-		printf("    indirect data blocks:");
-		union fs_block indirect_block;
-		disk_read(myInode->indirect, indirect_block.data);
-		
-		int j;
-		for (j = 0; j < POINTERS_PER_BLOCK; j++) {
-			if (indirect_block.pointers[j]) printf(" %d", indirect_block.pointers[j]);
-		}
+	for (i = 0; i < indirect_levels; i++) {
+		if (!myInode->indirect[i]) continue;
+		printf("    %sindirect block: %lld\n", levels[i], (long long)myInode->indirect[i]);
+		printf("    %sindirect data blocks:", levels[i]);
+		dispTree(myInode->indirect[i], i+1);
 		printf("\n");
-
 	}
 
 }
@@ -147,36 +660,281 @@ void fs_debug()
 {
 
 	union fs_block block;
+	struct fs_inode inode;
 
 	disk_read(0,block.data);
 
 	printf("superblock:\n");
-	printf("    %d blocks\n",block.super.nblocks);
-	printf("    %d inode blocks\n",block.super.ninodeblocks);
-	printf("    %d inodes\n",block.super.ninodes);
+	if (block.super64.magic == FS_MAGIC64) {
+		printf("    revision %d\n",block.super64.revision);
+		printf("    %lld blocks\n",(long long)block.super64.nblocks);
+		printf("    %lld inode blocks\n",(long long)block.super64.ninodeblocks);
+		printf("    %lld inodes\n",(long long)block.super64.ninodes);
+		printf("    %d byte blocks\n",block.super64.block_size);
+		printf("    %d block groups of %lld blocks\n",block.super64.ngroups,(long long)block.super64.blocks_per_group);
+	}
+	else {
+		printf("    %d blocks\n",block.super.nblocks);
+		printf("    %d inode blocks\n",block.super.ninodeblocks);
+		printf("    %d inodes\n",block.super.ninodes);
+		if (block.super.block_size) printf("    %d byte blocks\n",block.super.block_size);
+		if (block.super.ngroups) printf("    %d block groups of %d blocks\n",block.super.ngroups,block.super.blocks_per_group);
+	}
 
-	int i, j;
-	for (i = 1; i <= block.super.ninodeblocks; i++) {
-		disk_read(i, block.data);
-		for (j = 0; j < INODES_PER_BLOCK; j++) {
-			if (block.inode[j].isvalid) dispInode(&(block.inode[j]), i, j);
+	if (!fs_mounted && !loadSuperblock(&block)) return;
+
+	int g, j;
+	int64_t i;
+	for (g = 0; g < ngroups; g++) {
+		if (groups[g].itable_unused) printf("group %d: %lld inode blocks uninitialized\n",g,(long long)groups[g].itable_unused);
+		if (fs_mounted && ngroups > 1) printf("group %d: %lld free blocks, %d free inodes\n",g,(long long)groups[g].nfree,groups[g].nfreeinodes);
+
+		for (i = groups[g].inode_table; inodeBlockInitialized(g, i); i++) {
+			disk_read(i, block.data);
+			for (j = 0; j < inodes_per_block; j++) {
+				getInode(&block, j, &inode);
+				if (inode.isvalid) dispInode(&inode, inodeNumber(g, i, j));
+			}
+		}
+	}
+
+}
+
+//Image statistics gathered in one pass over the inode tables, for images too large for fs_debug
+#define FS_STATS_BUCKETS 64
+#define FS_STATS_BATCH   (1 << 20)	//bytes of inode table read at a time
+
+struct fs_stats {
+	int64_t files;
+	int64_t bytes;
+	int64_t data_blocks;
+	int64_t pointer_blocks;
+	int64_t extents;
+	int64_t fragmented;	//files in more than one extent
+	int64_t size_hist[FS_STATS_BUCKETS];
+	int64_t extent_hist[FS_STATS_BUCKETS];
+	int64_t free_hist[FS_STATS_BUCKETS];
+	int64_t free_hist_blocks[FS_STATS_BUCKETS];
+};
+
+//Where the walk of one file's blocks has got to, in logical order
+struct fs_extent_walk {
+	int64_t next;		//physical block that would continue the current extent, 0 after a hole
+	int64_t extents;
+	int64_t blocks;
+	int64_t pointer_blocks;
+};
+
+int histBucket(int64_t n){
+//Power of two buckets: 0 holds 0 and 1, k holds [2^k, 2^(k+1))
+	int k = 0;
+	while(n > 1 && k < FS_STATS_BUCKETS-1){
+		n >>= 1;
+		k++;
+	}
+	return k;
+}
+
+void extentBlock(struct fs_extent_walk *w, int64_t p){
+	p = BLOCKNUM(p);
+	if(p != w->next) w->extents++;
+	w->next = p + 1;
+	w->blocks++;
+}
+
+void extentTree(struct fs_extent_walk *w, int64_t blocknum, int depth){
+	union fs_block block;
+	int i;
+
+	w->pointer_blocks++;
+	disk_read(blocknum, block.data);
+	for(i = 0; i < pointers_per_block; i++){
+		int64_t p = getPointer(&block, i);
+		if(!p) w->next = 0;
+		else if(depth == 1) extentBlock(w, p);
+		else extentTree(w, p, depth-1);
+	}
+}
+
+void statInode(struct fs_stats *st, const struct fs_inode *inode){
+	struct fs_extent_walk w = { 0, 0, 0, 0 };
+	int i;
+
+	for(i = 0; i < direct_pointers; i++){
+		if(inode->direct[i]) extentBlock(&w, inode->direct[i]);
+		else w.next = 0;
+	}
+	for(i = 0; i < indirect_levels; i++){
+		if(inode->indirect[i]) extentTree(&w, inode->indirect[i], i+1);
+		else w.next = 0;
+	}
+
+	st->files++;
+	st->bytes += inode->size;
+	st->data_blocks += w.blocks;
+	st->pointer_blocks += w.pointer_blocks;
+	st->extents += w.extents;
+	if(w.extents > 1) st->fragmented++;
+	st->size_hist[histBucket(inode->size)]++;
+	st->extent_hist[histBucket(w.extents)]++;
+}
+
+void printHist(const char *name, const int64_t *hist, const int64_t *blocks, const char *unit, int json){
+	int k, first = 1;
+
+	if(json) printf(",\n  \"%s\": [", name);
+	else printf("%s:\n", name);
+
+	for(k = 0; k < FS_STATS_BUCKETS; k++){
+		if(!hist[k]) continue;
+		int64_t lo = k ? (int64_t)1 << k : 0, hi = ((int64_t)1 << (k+1)) - 1;
+		if(json){
+			printf("%s{\"min\": %lld, \"max\": %lld, \"count\": %lld", first ? "" : ", ", (long long)lo, (long long)hi, (long long)hist[k]);
+			if(blocks) printf(", \"blocks\": %lld", (long long)blocks[k]);
+			printf("}");
+		}
+		else {
+			printf("    %12lld - %-12lld %s: %10lld", (long long)lo, (long long)hi, unit, (long long)hist[k]);
+			if(blocks) printf(" (%lld blocks)", (long long)blocks[k]);
+			printf("\n");
+		}
+		first = 0;
+	}
+	if(json) printf("]");
+}
+
+int fs_stats( int json )
+{
+	if(!fs_mounted){
+		printf("There is no mounted disk\n");
+		return 0;
+	}
+
+	struct fs_stats *st = calloc(1, sizeof(struct fs_stats));
+	int batch = FS_STATS_BATCH / block_size;
+	char *table = malloc((size_t)batch * block_size);
+	if(!st || !table){
+		free(st);
+		free(table);
+		return 0;
+	}
+
+	int g, j, k;
+	int64_t i, n;
+	struct fs_inode inode;
+	for(g = 0; g < ngroups; g++){
+		//only the initialized part of each table can hold inodes, and it is read in large batches
+		int64_t end = tableEnd(g) - groups[g].itable_unused;
+		for(i = groups[g].inode_table; i < end; i += n){
+			n = (end - i < batch) ? end - i : batch;
+			disk_read_range(i, n, table);
+
+			for(k = 0; k < n; k++){
+				union fs_block *block = (union fs_block *)(table + (size_t)k * block_size);
+				for(j = 0; j < inodes_per_block; j++){
+					getInode(block, j, &inode);
+					if(inode.isvalid) statInode(st, &inode);
+				}
+			}
 		}
 
+		//free space runs, which do not cross group boundaries since allocation does not either
+		for(i = dataStart(g); i < groups[g].end; i++){
+			if(free_bitmap[i]) continue;
+			int64_t start = i;
+			while(i < groups[g].end && !free_bitmap[i]) i++;
+			st->free_hist[histBucket(i - start)]++;
+			st->free_hist_blocks[histBucket(i - start)] += i - start;
+		}
+	}
+	free(table);
+
+	int64_t nfree = 0, ninodes = (int64_t)ngroups*inodeblocks_per_group*inodes_per_block;
+	for(g = 0; g < ngroups; g++) nfree += groups[g].nfree;
+
+	if(json){
+		printf("{\n  \"revision\": %d, \"block_size\": %d, \"blocks\": %lld, \"free_blocks\": %lld, \"inodes\": %lld,\n",
+			revision, block_size, (long long)fs_nblocks, (long long)nfree, (long long)ninodes);
+		printf("  \"files\": %lld, \"bytes\": %lld, \"data_blocks\": %lld, \"pointer_blocks\": %lld, \"extents\": %lld, \"fragmented_files\": %lld",
+			(long long)st->files, (long long)st->bytes, (long long)st->data_blocks, (long long)st->pointer_blocks, (long long)st->extents, (long long)st->fragmented);
+		printHist("file_sizes", st->size_hist, 0, "bytes", 1);
+		printHist("extents_per_file", st->extent_hist, 0, "extents", 1);
+		printHist("free_runs", st->free_hist, st->free_hist_blocks, "blocks", 1);
+		printf(",\n  \"groups\": [");
+		for(g = 0; g < ngroups; g++){
+			printf("%s\n    {\"group\": %d, \"blocks\": %lld, \"free_blocks\": %lld, \"free_inodes\": %d}", g ? "," : "",
+				g, (long long)(groups[g].end - dataStart(g)), (long long)groups[g].nfree, groups[g].nfreeinodes);
+		}
+		printf("\n  ]\n}\n");
+	}
+	else {
+		printf("%lld blocks of %d bytes, %lld free\n", (long long)fs_nblocks, block_size, (long long)nfree);
+		printf("%lld files holding %lld bytes in %lld data and %lld pointer blocks\n",
+			(long long)st->files, (long long)st->bytes, (long long)st->data_blocks, (long long)st->pointer_blocks);
+		printf("%lld extents, %lld files fragmented, %.2f extents per file\n",
+			(long long)st->extents, (long long)st->fragmented, st->files ? (double)st->extents / st->files : 0.0);
+		printHist("file sizes", st->size_hist, 0, "bytes", 0);
+		printHist("extents per file", st->extent_hist, 0, "extents", 0);
+		printHist("free space runs", st->free_hist, st->free_hist_blocks, "blocks", 0);
+		printf("groups:\n");
+		for(g = 0; g < ngroups; g++){
+			int64_t size = groups[g].end - dataStart(g);
+			printf("    group %d: %5.1f%% of %lld blocks used, %d free inodes\n", g,
+				size ? 100.0 * (size - groups[g].nfree) / size : 0.0, (long long)size, groups[g].nfreeinodes);
+		}
 	}
 
+	free(st);
+	return 1;
 }
 
-int fs_format()
+int fs_format( int size )
 {
 	if (fs_mounted) return 0;
-	
+	if (!setBlockSize(size)) return 0;
+	setRevision(FS_REVISION);
+
 	union fs_block datablock;
-	datablock.super.magic = FS_MAGIC;
-	datablock.super.nblocks = disk_size();
-	datablock.super.ninodeblocks = calcInodeBlocks();
-	datablock.super.ninodes = calcInodeBlocks()*INODES_PER_BLOCK;
+	memset(datablock.data, 0, block_size);
+
+	int64_t nblocks = disk_size();
+	int64_t bpg = FS_BLOCKS_PER_GROUP;
+	int64_t ipg, maxipg;
+	int g, n;
+
+	//Groups grow past the default size once the descriptors would not fit in the superblock
+	while ((nblocks + bpg - 1) / bpg > FS_MAX_GROUPS64) bpg *= 2;
+	n = (nblocks + bpg - 1) / bpg;
+	ipg = bpg / 10 + (bpg % 10 ? 1 : 0);
+
+	//A short last group that cannot hold its own inode slice is folded into the one before it
+	if (n > 1 && nblocks - (n-1)*bpg <= ipg + 1) n--;
+	if (n == 1) {
+		bpg = nblocks;
+		ipg = calcInodeBlocks();
+	}
 
-	invalidateInodes(calcInodeBlocks());
+	//Inode numbers are ints, so the largest disks get fewer inodes than blocks/10 would give
+	maxipg = INT_MAX / inodes_per_block / n;
+	if (ipg > maxipg) ipg = maxipg;
+
+	datablock.super64.magic = FS_MAGIC64;
+	datablock.super64.revision = FS_REVISION;
+	datablock.super64.block_size = block_size;
+	datablock.super64.ngroups = n;
+	datablock.super64.nblocks = nblocks;
+	datablock.super64.ninodeblocks = n*ipg;
+	datablock.super64.ninodes = n*ipg*inodes_per_block;
+	datablock.super64.blocks_per_group = bpg;
+	datablock.super64.inodeblocks_per_group = ipg;
+
+	for (g = 0; g < n; g++) {
+		//Group 0 shares its first block with the superblock
+		datablock.super64.groups[g].inode_table = g ? g*bpg : 1;
+
+		//The inode tables are zeroed lazily as inodes are first handed out
+		datablock.super64.groups[g].itable_unused = ipg;
+	}
 
 	disk_write(0, datablock.data);
 	return 1;
@@ -185,25 +943,40 @@ int fs_format()
 
 int fs_mount()
 {
-	
+
 	union fs_block block;
-	disk_read(0,block.data);
-	if(block.super.magic != FS_MAGIC) return 0;
-	
+	if(!loadSuperblock(&block)) return 0;
+
 	//allocate space for bitmap
-	free_bitmap = calloc(block.super.nblocks,sizeof(int));
+	free(free_bitmap);
+	free_bitmap = calloc(fs_nblocks,sizeof(unsigned char));
 	if(!free_bitmap) return 0;
-	in_blocks = block.super.ninodeblocks;
 	fs_mounted = 1;
+	blockMapInvalidate(0);
 	updateBitmap();
 	return 1;
 }
 
 
+int pickGroup(){
+//Place new files in the first group with at least average free space, so their data stays near the inode
+	int g;
+	int64_t total = 0;
+	for(g = 0; g < ngroups; g++) total += groups[g].nfree;
+
+	for(g = 0; g < ngroups; g++){
+		if(groups[g].nfreeinodes && groups[g].nfree*ngroups >= total) return g;
+	}
+	for(g = 0; g < ngroups; g++){
+		if(groups[g].nfreeinodes) return g;
+	}
+	return -1;
+}
+
 int fs_create()
 {
 	int inodeIndex;
-	int inodeBlockIndex;
+	int64_t inodeBlockIndex;
 
 	//check if there is a mounted disk
     if(free_bitmap == NULL){
@@ -212,40 +985,36 @@ int fs_create()
     }
 
     union fs_block block;
-    disk_read(0, block.data);
-    
-    for(inodeBlockIndex = 1; inodeBlockIndex < block.super.nblocks; inodeBlockIndex++){
+    int g = pickGroup();
+
+    for(inodeBlockIndex = g >= 0 ? groups[g].inode_table : 0; g >= 0 && inodeBlockIndex < tableEnd(g); inodeBlockIndex++){
 
         //read and start checking for open spaces for open spaces
-        disk_read(inodeBlockIndex, block.data);
+        readInodeBlock(g, inodeBlockIndex, &block);
         struct fs_inode inode;
 
-        for(inodeIndex = 0; inodeIndex < POINTERS_PER_BLOCK; inodeIndex++){            
+        for(inodeIndex = 0; inodeIndex < inodes_per_block; inodeIndex++){
 			//0 cannot be a valid inumber
-			if(inodeBlockIndex == 1 && inodeIndex == 0){
-				inodeIndex = 1;
-			}
+			if(inodeNumber(g, inodeBlockIndex, inodeIndex) == 0) continue;
 
-            inode = block.inode[inodeIndex];            
+            getInode(&block, inodeIndex, &inode);
 
-            if(inode.isvalid == 0){                
+            if(inode.isvalid == 0){
 
                 //we can fill the space if the inode is invalid
 				//create a new inode of zero length
+                memset(&inode, 0, sizeof(inode));
                 inode.isvalid = 1;
-                inode.size = 0;
-                memset(inode.direct, 0, sizeof(inode.direct));
-                inode.indirect = 0;                
 
-                free_bitmap[inodeBlockIndex] = 1;
+                groups[g].nfreeinodes--;
 
-                block.inode[inodeIndex] = inode;
+                putInode(&block, inodeIndex, &inode);
 
 				//write to disk
-                disk_write(inodeBlockIndex, block.data);
+                writeInodeBlock(g, inodeBlockIndex, &block);
 
 				//return the positive inode number
-                return inodeIndex + (inodeBlockIndex-1)*INODES_PER_BLOCK;
+                return inodeNumber(g, inodeBlockIndex, inodeIndex);
             }
         }
     }
@@ -263,95 +1032,69 @@ int fs_delete( int inumber )
         return 0;
 	}
 
+	union fs_block block;
+	struct fs_inode inode;
+
+	//Translate inumber to its group, iblock and local index
+	int g;
+	int64_t iblock;
+	int localInodeIndex = inodeLocation(inumber, &g, &iblock);
+
 	//Reject impossible inodes
-	if(inumber > in_blocks*INODES_PER_BLOCK - 1 || inumber < 1){
+	if(localInodeIndex < 0){
 		printf("Requested inode number is either too high or too low\n");
         return 0;
 	}
 
-	//union fs_block* block = (union fs_block*) malloc(sizeof(union fs_block));
-	union fs_block block;
-
-	//Translate inumber to iblock
-	int iblock = inumber/INODES_PER_BLOCK + 1;
-
-	//Translate inumber to local index
-	int localInodeIndex = inumber%INODES_PER_BLOCK;
-	
-	//Check to see if iblock is valid
-	if(!free_bitmap[iblock]){
-		printf("Invalid allocation for block containing requested inode\n");
-		return 0;
-	}
 	//Read in the iblock
-	disk_read(iblock, block.data);
+	readInodeBlock(g, iblock, &block);
+	getInode(&block, localInodeIndex, &inode);
 
 	//Check to see if inumber is valid
-	if(!block.inode[localInodeIndex].isvalid){
+	if(!inode.isvalid){
 		printf("Requested inode is not valid\n");
 		return 0;
 	}
-	//Iterate through direct pointers and free blocks referenced by valid pointers
-	int i;
-	for(i=0;i<POINTERS_PER_INODE;i++){
-		if(!block.inode[localInodeIndex].direct[i]) continue;
-		free_bitmap[block.inode[localInodeIndex].direct[i]] = 0;
-	}
-
-	//Check and iterate through indirect pointers
-	if(block.inode[localInodeIndex].indirect){
-		union fs_block ind_block;
-		disk_read(block.inode[localInodeIndex].indirect, ind_block.data);
 
-		//Iterate through pointers of indirect block
-		int k;
-		for(k=0;k<POINTERS_PER_BLOCK;k++){
-			if(!ind_block.pointers[k]) continue;
-			free_bitmap[ind_block.pointers[k]] = 0;
-		}
-
-	}
+	//Free the direct blocks and every level of indirect blocks
+	truncateBlocks(&inode, 0);
 
 	//Reset size
-	block.inode[localInodeIndex].size = 0;
-	
+	inode.size = 0;
+
 	//Invalidate Inode
-	block.inode[localInodeIndex].isvalid = 0;
-
-	//Check all inodes in inode block for any valid inode
-	int j, foundValidInode = 0;
-	for(j=0;j<INODES_PER_BLOCK;j++){
-		if(block.inode[j].isvalid){
-			foundValidInode = 1;
-			break;
-		}
-	}
-
-	//Invalidate inode block if its emptry
-	if(!foundValidInode) free_bitmap[iblock] = 0;
+	inode.isvalid = 0;
+	groups[g].nfreeinodes++;
 
+	putInode(&block, localInodeIndex, &inode);
 	disk_write(iblock, block.data);
+	mmapInvalidate(inumber, 0, INT64_MAX);
+	blockMapInvalidate(inumber);
+	mmapRemap(inumber);
 
 	return 1;
 }
 
-int fs_getsize( int inumber )
+off_t fs_getsize( int inumber )
 {
 	union fs_block block;
-	disk_read(0,block.data);
 
-	//find inode block (C rounds down)
+	if(!fs_mounted && !loadSuperblock(&block)) return -1;
 
-	int inodeBlockIndex = (inumber+INODES_PER_BLOCK-1)/INODES_PER_BLOCK;
+	//find the inode's group and block
+	int g;
+	int64_t iblock;
+	int index = inodeLocation(inumber, &g, &iblock);
 
 	//check number is within the limit
-	if(inodeBlockIndex > block.super.ninodeblocks){
+	if(index < 0){
 		printf("Inode number %d is outside the limit\n",inumber);
-		return 0;
+		return -1;
 	}
-	
-	disk_read(inodeBlockIndex,block.data);
-	struct fs_inode inode = block.inode[inumber%INODES_PER_BLOCK];
+
+	readInodeBlock(g, iblock, &block);
+	struct fs_inode inode;
+	getInode(&block, index, &inode);
 
 	//return the logical size of the given inode
 	if(inode.isvalid) {
@@ -359,204 +1102,1499 @@ int fs_getsize( int inumber )
 	}
 
 	//on failure return -1
-	printf("inode at inumber %d is invalid\n",inumber); 
+	printf("inode at inumber %d is invalid\n",inumber);
 
 	return -1;
 }
 
-int fs_read( int inumber, char *data, int length, int offset )
+int64_t allocInGroup(int g, int64_t goal){
+//First free data block of the group at or after goal, wrapping around to the group's start
+	int64_t i, start = dataStart(g);
+	if(!groups[g].nfree) return 0;
+	if(goal < start || goal >= groups[g].end) goal = start;
+
+	for(i=goal; i<groups[g].end; i++){
+		if(!free_bitmap[i]) break;
+	}
+	if(i == groups[g].end){
+		for(i=start; i<goal; i++){
+			if(!free_bitmap[i]) break;
+		}
+		if(i == goal) return 0;
+	}
+
+	free_bitmap[i] = 1;
+	groups[g].nfree--;
+	return i;
+}
+
+int64_t newBlock(int64_t goal){
+//Allocate near goal, falling back to the following groups in turn
+	int i, g = blockGroup(goal);
+	int64_t b;
+	for(i=0; i<ngroups; i++){
+		b = allocInGroup((g+i)%ngroups, i ? 0 : goal);
+		if(b) return b;
+	}
+	return 0;
+}
+
+int64_t runInGroup(int g, int64_t goal, int64_t want, int64_t *len){
+//First free run of want blocks in the group at or after goal, else the longest shorter run
+	int64_t i, start, best = 0, bestlen = 0;
+	if(!groups[g].nfree) return 0;
+	if(goal < dataStart(g) || goal >= groups[g].end) goal = dataStart(g);
+
+	for(i=goal; i<groups[g].end && bestlen<want; i++){
+		if(free_bitmap[i]) continue;
+		start = i;
+		while(i<groups[g].end && !free_bitmap[i] && i-start<want) i++;
+		if(i-start > bestlen){
+			best = start;
+			bestlen = i-start;
+		}
+	}
+
+	*len = bestlen;
+	return best;
+}
+
+int64_t allocRun(int64_t goal, int64_t want, int64_t *len){
+//Allocate up to want contiguous blocks near goal; returns the first block and sets len
+	int i, g = blockGroup(goal);
+	int64_t b, start = 0;
+	*len = 0;
+
+	for(i=0; i<ngroups && !start; i++){
+		int gg = (g+i)%ngroups;
+		start = runInGroup(gg, i ? 0 : goal, want, len);
+
+		//a run before the goal in its own group is still better than another group
+		if(!start && !i) start = runInGroup(gg, 0, want, len);
+	}
+	if(!start) return 0;
+
+	for(b=start; b<start+*len; b++) free_bitmap[b] = 1;
+	groups[blockGroup(start)].nfree -= *len;
+	return start;
+}
+
+//A walk over one file's block tree. The pointer block last used at each depth stays loaded,
+//so neighbouring logical blocks read it once; changed ones are written back as the walk moves on.
+
+struct fs_map {
+	struct fs_inode *inode;
+	int64_t blocknum[FS_INDIRECT_LEVELS];
+	int dirty[FS_INDIRECT_LEVELS];
+	union fs_block *blocks;
+};
+
+void mapInit(struct fs_map *map, struct fs_inode *inode){
+	memset(map, 0, sizeof(*map));
+	map->inode = inode;
+}
+
+void mapDone(struct fs_map *map){
+	int k;
+	for(k=0; k<FS_INDIRECT_LEVELS; k++){
+		if(map->dirty[k]) disk_write(map->blocknum[k], map->blocks[k].data);
+	}
+	free(map->blocks);
+}
+
+union fs_block *mapLoad(struct fs_map *map, int depth, int64_t blocknum, int fresh){
+//Bring a pointer block into the slot for its depth; a fresh block starts out empty
+	if(!map->blocks){
+		//walks that stay in the direct pointers never need the buffers
+		map->blocks = malloc(FS_INDIRECT_LEVELS * sizeof(union fs_block));
+		if(!map->blocks){
+			printf("ERROR: out of memory for the block map\n");
+			abort();
+		}
+	}
+	if(map->blocknum[depth] != blocknum){
+		if(map->dirty[depth]) disk_write(map->blocknum[depth], map->blocks[depth].data);
+		map->dirty[depth] = 0;
+		map->blocknum[depth] = blocknum;
+		if(!fresh) disk_read(blocknum, map->blocks[depth].data);
+	}
+	if(fresh){
+		memset(map->blocks[depth].data, 0, block_size);
+		map->dirty[depth] = 1;
+	}
+	return &map->blocks[depth];
+}
+
+int mapPath(int64_t lblock, int64_t *index, int *depth){
+//Split a logical block into the index used at each level of its tree; 0 if the file cannot reach it
+	int64_t span = 1;
+	int d, k;
+
+	if(lblock < direct_pointers){
+		*depth = 0;
+		index[0] = lblock;
+		return 1;
+	}
+	lblock -= direct_pointers;
+
+	for(d=1; d<=indirect_levels; d++){
+		span *= pointers_per_block;
+		if(lblock < span){
+			for(k=d-1; k>=0; k--){
+				index[k] = lblock % pointers_per_block;
+				lblock /= pointers_per_block;
+			}
+			*depth = d;
+			return 1;
+		}
+		lblock -= span;
+	}
+	return 0;
+}
+
+int64_t mapGet(struct fs_map *map, int64_t lblock){
+//The pointer for a logical block, or 0 for a hole
+	int64_t index[FS_INDIRECT_LEVELS], b;
+	int d, k;
+
+	if(!mapPath(lblock, index, &d)) return 0;
+	if(!d) return map->inode->direct[index[0]];
+
+	b = map->inode->indirect[d-1];
+	for(k=0; k<d && b; k++) b = getPointer(mapLoad(map, k, b, 0), index[k]);
+	return b;
+}
+
+int mapSet(struct fs_map *map, int64_t lblock, int64_t value, int64_t *goal){
+//Store the pointer for a logical block, allocating missing pointer blocks at *goal; 0 when the disk is full
+	int64_t index[FS_INDIRECT_LEVELS], b;
+	int d, k;
+
+	if(!mapPath(lblock, index, &d)) return 0;
+	if(!d){
+		map->inode->direct[index[0]] = value;
+		return 1;
+	}
+
+	b = map->inode->indirect[d-1];
+	if(!b){
+		if(!(b = newBlock(*goal))) return 0;
+		*goal = b + 1;
+		map->inode->indirect[d-1] = b;
+		mapLoad(map, 0, b, 1);
+	}
+
+	for(k=0; k<d; k++){
+		union fs_block *block = mapLoad(map, k, b, 0);
+		if(k == d-1){
+			setPointer(block, index[k], value);
+			map->dirty[k] = 1;
+			break;
+		}
+
+		b = getPointer(block, index[k]);
+		if(!b){
+			if(!(b = newBlock(*goal))) return 0;
+			*goal = b + 1;
+			setPointer(block, index[k], b);
+			map->dirty[k] = 1;
+			mapLoad(map, k+1, b, 1);
+		}
+	}
+	return 1;
+}
+
+//Decoded block maps of recently read files, so finding a block is an array index rather than a
+//walk down the pointer blocks. A map is dropped whenever a call moves any of its file's blocks.
+#define FS_BLOCKMAP_SLOTS 16
+#define FS_BLOCKMAP_MAX   (1 << 20)	//larger files are walked instead of decoded
+
+struct fs_blockmap {
+	int inumber;
+	int64_t nblocks;
+	int64_t *blocks;
+	unsigned long used;
+};
+
+struct fs_blockmap blockmaps[FS_BLOCKMAP_SLOTS];
+unsigned long blockmap_clock = 0;
+
+void blockMapInvalidate(int inumber){
+//Drop the decoded map of one file, or of every file for inode 0
+	int i;
+	for(i=0; i<FS_BLOCKMAP_SLOTS; i++){
+		if(!blockmaps[i].blocks || (inumber && blockmaps[i].inumber != inumber)) continue;
+		free(blockmaps[i].blocks);
+		memset(&blockmaps[i], 0, sizeof(blockmaps[i]));
+	}
+}
+
+void decodeTree(struct fs_blockmap *bm, int64_t blocknum, int depth, int64_t base){
+//Copy the pointers under a pointer block into the map; base is the first logical block it maps
+	union fs_block block;
+	int64_t span = levelSpan(depth);
+	int i;
+
+	disk_read(blocknum, block.data);
+	for(i=0; i<pointers_per_block && base + i*span < bm->nblocks; i++){
+		int64_t p = getPointer(&block, i);
+		if(!p) continue;
+		if(depth == 1) bm->blocks[base + i] = p;
+		else decodeTree(bm, p, depth-1, base + i*span);
+	}
+}
+
+int blockMapBuild(struct fs_blockmap *bm, int inumber, const struct fs_inode *inode){
+//Decode a file's whole map into an empty fs_blockmap; 0 if out of memory
+	int i, d;
+	int64_t base = direct_pointers, nblocks = (inode->size + block_size - 1) >> block_shift;
+
+	if(!(bm->blocks = calloc(nblocks ? nblocks : 1, sizeof(int64_t)))) return 0;
+	bm->inumber = inumber;
+	bm->nblocks = nblocks;
+
+	for(i=0; i<direct_pointers && i<nblocks; i++) bm->blocks[i] = inode->direct[i];
+	for(d=1; d<=indirect_levels && base<nblocks; d++){
+		if(inode->indirect[d-1]) decodeTree(bm, inode->indirect[d-1], d, base);
+		base += levelSpan(d+1);
+	}
+	return 1;
+}
+
+struct fs_blockmap *blockMap(int inumber, const struct fs_inode *inode){
+//The decoded map of a file, built on first use; 0 if the file is too large to decode
+	int i, slot = 0;
+
+	for(i=0; i<FS_BLOCKMAP_SLOTS; i++){
+		if(blockmaps[i].blocks && blockmaps[i].inumber == inumber){
+			blockmaps[i].used = ++blockmap_clock;
+			return &blockmaps[i];
+		}
+		if(blockmaps[i].used < blockmaps[slot].used) slot = i;
+	}
+	if(((inode->size + block_size - 1) >> block_shift) > FS_BLOCKMAP_MAX) return 0;
+
+	//the least recently used slot makes way
+	struct fs_blockmap *bm = &blockmaps[slot];
+	free(bm->blocks);
+	memset(bm, 0, sizeof(*bm));
+	if(!blockMapBuild(bm, inumber, inode)) return 0;
+	bm->used = ++blockmap_clock;
+	return bm;
+}
+
+int64_t fileBlock(struct fs_blockmap *bm, struct fs_map *map, int64_t lblock){
+//Look a logical block up in the decoded map when there is one, else walk the tree
+	if(bm) return (lblock < bm->nblocks) ? bm->blocks[lblock] : 0;
+	return mapGet(map, lblock);
+}
+
+off_t maxFileSize(){
+	int64_t blocks = direct_pointers;
+	int d;
+	for(d=1; d<=indirect_levels; d++) blocks += levelSpan(d+1);
+
+	//the old format keeps sizes in an int
+	if(!revision) return (blocks << block_shift > INT_MAX) ? INT_MAX : blocks << block_shift;
+	return (blocks > (INT64_MAX >> block_shift)) ? INT64_MAX : blocks << block_shift;
+}
+
+int fs_read( int inumber, char *data, int length, off_t offset )
 {
 
 	if(!fs_mounted){
 		printf("Error: the filesystem has not been mounted\n");
 		return 0;
 	}
-	if(inumber <= 0) {
-		printf("Error: enter a valid inode value\n");		
+	int g;
+	int64_t block_num;
+	int i_offset = inodeLocation(inumber, &g, &block_num);
+	if(i_offset < 0) {
+		printf("Error: enter a valid inode value\n");
 		return 0;
 	}
 
-	int i, j, dblock, bytes_read=0;
-	union fs_block block, indirect_block;
+	int bytes_read=0;
+	union fs_block block, data_block;
 	struct fs_inode inode;
-	char loop_data[4096]="";
-	char total_data[16384]="";
-	
-
-	//local inode number
-	int i_offset = inumber % INODES_PER_BLOCK ;
-	int block_num = inumber/INODES_PER_BLOCK + 1;
-	int pointer_offset = offset/4096;
+	struct fs_map map;
 
 	//go to the inode's block
-	disk_read(block_num, block.data);
-	
-	inode = block.inode[i_offset];
-	int isize=inode.size;
+	readInodeBlock(g, block_num, &block);
+
+	getInode(&block, i_offset, &inode);
+	off_t isize=inode.size;
 
-	if((!inode.isvalid) || !isize) return 0;
+	if((!inode.isvalid) || offset < 0 || offset >= isize || length <= 0) return 0;
 
 	int bytes_left = ((isize-offset) < length) ? isize-offset : length;
 
-	//go through each direct pointer in the inode
-	for(i=pointer_offset; i<POINTERS_PER_INODE; i++){
-		dblock = inode.direct[i];
-		if(dblock){
-			disk_read(dblock, *(&loop_data));
-			strcat(*(&total_data), *(&loop_data));
-			bytes_read += ((bytes_left-bytes_read) < 4096) ? bytes_left-bytes_read : 4096;
-			
-			if(bytes_read >= bytes_left){
-				strcpy(data, total_data);
-				return bytes_read;
-			}
+	struct fs_blockmap *bm = blockMap(inumber, &inode);
+	mapInit(&map, &inode);
+	while(bytes_read < bytes_left){
+		off_t pos = offset + bytes_read;
+		int boff = pos & (block_size-1);
+		int n = (block_size-boff < bytes_left-bytes_read) ? block_size-boff : bytes_left-bytes_read;
+		int64_t b = WRITTEN(fileBlock(bm, &map, pos >> block_shift));
+
+		//blocks that were never written, or only reserved, read back as zeros
+		if(b){
+			disk_read(b, data_block.data);
+			memcpy(&data[bytes_read], &data_block.data[boff], n);
 		}
-	}
-
-	if(inode.indirect){
-		disk_read(inode.indirect, indirect_block.data);
-		
-		//go through all the pointers in the indirect block, starting at offset
-		for(j=(pointer_offset<5) ? 0 : pointer_offset-5; j<POINTERS_PER_BLOCK; j++) {
-			if (indirect_block.pointers[j]){
-				disk_read(indirect_block.pointers[j], *(&loop_data));
-				strcat(*(&total_data), *(&loop_data));
-				bytes_read += ((bytes_left-bytes_read) < 4096) ? bytes_left-bytes_read : 4096;
+		else memset(&data[bytes_read], 0, n);
 
-				if(bytes_read >= bytes_left){
-					strcpy(data, total_data);
-					return bytes_read;
-				}
-			}
-		}
+		bytes_read += n;
 	}
-	
+	mapDone(&map);
+
 	return bytes_read;
 }
 
 
-int newBlock(int blocks){
-	int i;
-	for(i=0; i<blocks; i++){
-		if(!free_bitmap[i]){
-			free_bitmap[i] = 1;
-			return i;
-		}
-	}
-	return 0;
+void releaseBlocks(struct fs_inode *inode){
+//Free every block of the file and leave it empty
+	truncateBlocks(inode, 0);
+	inode->size = 0;
 }
 
-int fs_write( int inumber, const char *data, int length, int offset )
-{	
+int fs_write( int inumber, const char *data, int length, off_t offset )
+{
 
 	if(!fs_mounted){
     printf("Error: the filesystem has not been mounted\n");
     return 0;
   }
-  if(inumber <= 0) {
-    printf("Error: enter a valid inode value\n");   
+  int g;
+  int64_t block_num;
+  int i_offset = inodeLocation(inumber, &g, &block_num);
+  if(i_offset < 0) {
+    printf("Error: enter a valid inode value\n");
     return 0;
   }
-	union fs_block block, indirect_block, super_block;
-  int i, j, new_block, bytes_written=0;
-	char total_data[16384]="";
-	strcpy(total_data, data);
-
-  disk_read(0,super_block.data);
-
-  //local inode number
-  int i_offset = inumber % INODES_PER_BLOCK;
-  int block_num = inumber/INODES_PER_BLOCK + 1;
-	int pointer_offset = offset/4096;
+	union fs_block block, data_block;
+	struct fs_inode inode;
+	struct fs_map map;
+	int bytes_written=0, moved=0;
 
   //go to the inode's block
-  disk_read(block_num, block.data);
+  readInodeBlock(g, block_num, &block);
+	getInode(&block, i_offset, &inode);
+
+  if(!inode.isvalid || offset < 0 || length <= 0) return 0;
 
-	int isize = (POINTERS_PER_INODE+POINTERS_PER_BLOCK)*4096;
+	off_t isize = maxFileSize();
+	if(offset >= isize) return 0;
 	int bytes_left = ((isize-offset) < length) ? isize-offset : length;
 
-  if(!block.inode[i_offset].isvalid) return 0;
-
-	//at the start, when offset is 0, reset direct and indirect pointers to 0
-	if(offset==0){ 
-		int x;
-		for(x=0;x<POINTERS_PER_INODE;x++){
-    	if(block.inode[i_offset].direct[x]<=0) continue;
-    	free_bitmap[block.inode[i_offset].direct[x]] = 0;
-			block.inode[i_offset].direct[x]=0;
-  	}
-	
-		if(block.inode[i_offset].indirect>0){
-			union fs_block ind_block;	
-    	disk_read(block.inode[i_offset].indirect, ind_block.data);
-
-    	//Iterate through pointers of indirect block
-			int y;
-    	for(y=0;y<POINTERS_PER_BLOCK;y++){
-      	if(ind_block.pointers[y]<=0) continue;
-      	free_bitmap[ind_block.pointers[y]] = 0;
-				ind_block.pointers[y] = 0;
-    	}
-			disk_write(block.inode[i_offset].indirect, ind_block.data);
-			free_bitmap[block.inode[i_offset].indirect] = 0;
-      block.inode[i_offset].indirect = 0;
-  	}
+	mapInit(&map, &inode);
+
+	//keep the file's blocks together, starting in the inode's own group
+	int64_t goal = dataStart(g);
+	int64_t lblock = offset >> block_shift;
+	int64_t prev = lblock ? mapGet(&map, lblock-1) : 0;
+	if(prev) goal = BLOCKNUM(prev) + 1;
+
+	while(bytes_written < bytes_left){
+		off_t pos = offset + bytes_written;
+		int boff = pos & (block_size-1);
+		int n = (block_size-boff < bytes_left-bytes_written) ? block_size-boff : bytes_left-bytes_written;
+		int fresh = 0;
+
+		lblock = pos >> block_shift;
+
+		int64_t b = mapGet(&map, lblock);
+		if(!b){
+			//pointer blocks on the way go first, so the data behind them stays in one run
+			if(!mapSet(&map, lblock, 0, &goal) || !(b = newBlock(goal))){
+				printf("Error: There are not enough free blocks.\n");
+				break;
+			}
+			mapSet(&map, lblock, b, &goal);
+			fresh = moved = 1;
+		}
+		else if(b & FS_UNWRITTEN){
+			//a reserved block is already in place, it only needs its first data
+			b = BLOCKNUM(b);
+			mapSet(&map, lblock, b, &goal);
+			fresh = moved = 1;
+		}
+		goal = b + 1;
+
+		//partial blocks keep the bytes around the written range
+		if(n < block_size){
+			if(fresh) memset(data_block.data, 0, block_size);
+			else disk_read(b, data_block.data);
+		}
+		memcpy(&data_block.data[boff], &data[bytes_written], n);
+		disk_write(b, data_block.data);
+
+		bytes_written += n;
+	}
+
+	if(offset+bytes_written > inode.size) inode.size = offset+bytes_written;
+	mapDone(&map);
+	putInode(&block, i_offset, &inode);
+	disk_write(block_num, block.data);
+	mmapInvalidate(inumber, offset, bytes_written);
+
+	//overwriting blocks in place leaves the decoded maps as they were
+	if(moved){
+		blockMapInvalidate(inumber);
+		mmapRemap(inumber);
+	}
+
+  return bytes_written;
+}
+
+off_t fs_import( int inumber, const char *filename )
+{
+	if(!fs_mounted){
+		printf("Error: the filesystem has not been mounted\n");
+		return -1;
+	}
+	int g;
+	int64_t block_num;
+	int i_offset = inodeLocation(inumber, &g, &block_num);
+	if(i_offset < 0) {
+		printf("Error: enter a valid inode value\n");
+		return -1;
+	}
+
+	union fs_block block, data_block;
+	struct fs_inode inode;
+	readInodeBlock(g, block_num, &block);
+	getInode(&block, i_offset, &inode);
+	if(!inode.isvalid){
+		printf("Error: inode %d is not valid\n", inumber);
+		return -1;
+	}
+
+	int fd = open(filename, O_RDONLY);
+	struct stat info;
+	if(fd < 0 || fstat(fd, &info) < 0){
+		printf("couldn't open %s: %s\n", filename, strerror(errno));
+		if(fd >= 0) close(fd);
+		return -1;
+	}
+
+	off_t size = info.st_size;
+	if(size > maxFileSize()){
+		printf("WARNING: %s is larger than the largest file, only %lld bytes fit\n", filename, (long long)maxFileSize());
+		size = maxFileSize();
+	}
+
+	//the import replaces the file, so its old blocks go first
+	releaseBlocks(&inode);
+
+	int64_t nblocks = (size + block_size - 1) >> block_shift;
+	int64_t *map = malloc((nblocks + 1) * sizeof(int64_t));
+	if(!map){
+		close(fd);
+		putInode(&block, i_offset, &inode);
 		disk_write(block_num, block.data);
+		return -1;
+	}
+
+	//the pointer blocks written after the data come out of the same free space, so room is kept for them
+	int64_t nfree = 0, want = nblocks;
+	int gg;
+	for(gg = 0; gg < ngroups; gg++) nfree += groups[gg].nfree;
+	if(nblocks > nfree) nblocks = nfree;
+	while(nblocks > 0 && nblocks + pointerBlocks(nblocks) > nfree) nblocks--;
+
+	//size the whole allocation up front, in as few runs as the free space allows
+	int64_t goal = dataStart(g), done = 0, len, start;
+	while(done < nblocks){
+		start = allocRun(goal, nblocks - done, &len);
+		if(!start) break;
+		for(; len > 0; len--) map[done++] = start++;
+		goal = start;
+	}
+	if(done < want){
+		printf("Error: There are not enough free blocks.\n");
+		nblocks = done;
+		if(size > nblocks << block_shift) size = nblocks << block_shift;
+	}
+
+	//move each physically contiguous run of whole blocks in one copy
+	int64_t full = size >> block_shift, i = 0;
+	int ok = 1;
+	while(ok && i < full){
+		int run = 1;
+		while(i + run < full && run < INT_MAX && map[i + run] == map[i] + run) run++;
+		ok = disk_copy_from_fd(fd, i << block_shift, map[i], run);
+		i += run;
+	}
+
+	//the last partial block is zero padded so nothing stale follows the end of the file
+	if(ok && full < nblocks){
+		int tail = size - (full << block_shift);
+		memset(data_block.data, 0, block_size);
+		ok = pread(fd, data_block.data, tail, full << block_shift) == tail;
+		if(ok) disk_write(map[full], data_block.data);
+	}
+	close(fd);
+
+	//a failed import leaves an empty file, so none of the blocks taken for it are kept
+	if(!ok){
+		printf("Error: couldn't read %s\n", filename);
+		for(i = 0; i < nblocks; i++) freeBlock(map[i]);
+		nblocks = 0;
+		size = 0;
+	}
+
+	//metadata is written once, after all of the data
+	struct fs_map m;
+	mapInit(&m, &inode);
+	for(i = 0; i < nblocks; i++){
+		if(mapSet(&m, i, map[i], &goal)) continue;
+
+		//no room left for pointer blocks, so the file ends where its map does
+		printf("Error: There are not enough free blocks.\n");
+		int64_t mapped = i;
+		for(; i < nblocks; i++) freeBlock(map[i]);
+		nblocks = mapped;
+		if(size > nblocks << block_shift) size = nblocks << block_shift;
+	}
+	mapDone(&m);
+	inode.size = size;
+	putInode(&block, i_offset, &inode);
+	disk_write(block_num, block.data);
+	mmapInvalidate(inumber, 0, INT64_MAX);
+	blockMapInvalidate(inumber);
+	mmapRemap(inumber);
+
+	free(map);
+	return size;
+}
+
+off_t fs_export( int inumber, const char *filename )
+{
+	if(!fs_mounted){
+		printf("Error: the filesystem has not been mounted\n");
+		return -1;
+	}
+	int g;
+	int64_t block_num;
+	int i_offset = inodeLocation(inumber, &g, &block_num);
+	if(i_offset < 0) {
+		printf("Error: enter a valid inode value\n");
+		return -1;
+	}
+
+	union fs_block block, data_block;
+	struct fs_inode inode;
+	readInodeBlock(g, block_num, &block);
+	getInode(&block, i_offset, &inode);
+	if(!inode.isvalid){
+		printf("Error: inode %d is not valid\n", inumber);
+		return -1;
+	}
+
+	int fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if(fd < 0){
+		printf("couldn't open %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	//the output may share a descriptor with our own buffered messages
+	fflush(stdout);
+
+	struct fs_map map;
+	int64_t nblocks = (inode.size + block_size - 1) >> block_shift;
+	int64_t i = 0;
+	int ok = 1;
+	memset(data_block.data, 0, block_size);
+	mapInit(&map, &inode);
+
+	while(ok && i < nblocks){
+		int64_t first = WRITTEN(mapGet(&map, i));
+		int run = 1;
+
+		//extend over the following logical blocks while they stay physically adjacent
+		while(i + run < nblocks && run < INT_MAX){
+			int64_t b = WRITTEN(mapGet(&map, i + run));
+			if(first ? b != first + run : b != 0) break;
+			run++;
+		}
+
+		off_t bytes = (off_t)run << block_shift;
+		if(((i + run) << block_shift) > inode.size) bytes = inode.size - (i << block_shift);
+
+		if(first) ok = disk_copy_to_fd(first, run, fd, bytes);
+		else {
+			//holes and reserved blocks come out as zeros
+			while(ok && bytes > 0){
+				int n = (bytes < block_size) ? bytes : block_size;
+				ok = write(fd, data_block.data, n) == n;
+				bytes -= n;
+			}
+		}
+		i += run;
+	}
+	mapDone(&map);
+	close(fd);
+
+	if(!ok){
+		printf("Error: couldn't write %s\n", filename);
+		return -1;
+	}
+	return inode.size;
+}
+
+off_t fs_truncate( int inumber, off_t size )
+{
+	if(!fs_mounted){
+		printf("Error: the filesystem has not been mounted\n");
+		return -1;
+	}
+	int g;
+	int64_t block_num;
+	int i_offset = inodeLocation(inumber, &g, &block_num);
+	if(i_offset < 0) {
+		printf("Error: enter a valid inode value\n");
+		return -1;
 	}
-	
 
-  //go through each direct pointer in the inode
-  for(i=pointer_offset; i<POINTERS_PER_INODE; i++){
-		new_block = newBlock(super_block.super.nblocks);
-		//if the disk is full, there are no more blocks left
-		if(!new_block){
+	union fs_block block, data_block;
+	struct fs_inode inode;
+	readInodeBlock(g, block_num, &block);
+	getInode(&block, i_offset, &inode);
+	if(!inode.isvalid){
+		printf("Error: inode %d is not valid\n", inumber);
+		return -1;
+	}
+	if(size < 0 || size > maxFileSize()){
+		printf("Error: size must be between 0 and %lld bytes\n", (long long)maxFileSize());
+		return -1;
+	}
+
+	int64_t keep = (size + block_size - 1) >> block_shift;
+
+	//the rest of the new last block is cleared so growing the file again reads zeros
+	int boff = size & (block_size-1);
+	if(size < inode.size && boff){
+		struct fs_map map;
+		mapInit(&map, &inode);
+		int64_t b = WRITTEN(mapGet(&map, size >> block_shift));
+		mapDone(&map);
+		if(b){
+			disk_read(b, data_block.data);
+			memset(&data_block.data[boff], 0, block_size-boff);
+			disk_write(b, data_block.data);
+		}
+	}
+
+	//everything past the new end goes in one pass, including reservations
+	truncateBlocks(&inode, keep);
+
+	blockMapInvalidate(inumber);
+
+	off_t oldsize = inode.size;
+	inode.size = size;
+	putInode(&block, i_offset, &inode);
+	disk_write(block_num, block.data);
+
+	//mapped blocks from the new end on no longer match the file
+	if(size < oldsize) mmapInvalidate(inumber, size, oldsize - size);
+	mmapRemap(inumber);
+
+	return size;
+}
+
+int64_t fs_fallocate( int inumber, off_t offset, off_t length )
+{
+	if(!fs_mounted){
+		printf("Error: the filesystem has not been mounted\n");
+		return -1;
+	}
+	int g;
+	int64_t block_num;
+	int i_offset = inodeLocation(inumber, &g, &block_num);
+	if(i_offset < 0) {
+		printf("Error: enter a valid inode value\n");
+		return -1;
+	}
+
+	union fs_block block;
+	struct fs_inode inode;
+	readInodeBlock(g, block_num, &block);
+	getInode(&block, i_offset, &inode);
+	if(!inode.isvalid){
+		printf("Error: inode %d is not valid\n", inumber);
+		return -1;
+	}
+	if(offset < 0 || length <= 0 || offset >= maxFileSize()){
+		printf("Error: the range must start between 0 and %lld bytes\n", (long long)maxFileSize());
+		return -1;
+	}
+	if(length > maxFileSize() - offset) length = maxFileSize() - offset;
+
+	struct fs_map map;
+	int64_t first = offset >> block_shift, last = (offset + length - 1) >> block_shift;
+	int64_t i, lblock, total = 0;
+	mapInit(&map, &inode);
+
+	//reservations continue from the block before the range, like an appending write
+	int64_t goal = dataStart(g);
+	int64_t prev = first ? mapGet(&map, first-1) : 0;
+	if(prev) goal = BLOCKNUM(prev) + 1;
+
+	for(lblock=first; lblock<=last; ){
+		int64_t b = mapGet(&map, lblock);
+		if(b){
+			goal = BLOCKNUM(b) + 1;
+			lblock++;
+			continue;
+		}
+
+		//ask for the whole hole at once so it lands in as few runs as possible
+		int64_t want = 1, len;
+		while(lblock+want <= last && !mapGet(&map, lblock+want)) want++;
+
+		//the pointer blocks in front of the hole go first so the run lands behind them
+		int64_t start = mapSet(&map, lblock, 0, &goal) ? allocRun(goal, want, &len) : 0;
+		if(!start){
 			printf("Error: There are not enough free blocks.\n");
-			block.inode[i_offset].size = offset+bytes_written;
-			disk_write(block_num, block.data);
-			return bytes_written;
-		}
-		block.inode[i_offset].direct[i] = new_block;
-    disk_write(block.inode[i_offset].direct[i], total_data);
-    bytes_written += ((bytes_left-bytes_written) < 4096) ? bytes_left-bytes_written : 4096;
-		strcpy(total_data, &data[bytes_written]);
-    if(bytes_written >= bytes_left){ 
-			block.inode[i_offset].size = offset+bytes_written;
- 			disk_write(block_num, block.data);
-			return bytes_written;
+			break;
 		}
-  }
-	
-	//check if you need to create an indirect block
-	if(!block.inode[i_offset].indirect){
-		block.inode[i_offset].indirect = newBlock(super_block.super.nblocks);
-		disk_write(block.inode[i_offset].indirect, indirect_block.data);
-	}
-
-  //go through all the pointers in the indirect block
-	for(j=(pointer_offset<5) ? 0 : pointer_offset-5; j<POINTERS_PER_BLOCK; j++) {
-		new_block = newBlock(super_block.super.nblocks);
-		//if the disk is full, there are no more blocks left
-    if(!new_block){
+
+		//reserved blocks are never written, which is what would otherwise cancel their pending discards
+		disk_discard_cancel(start, len);
+		goal = start + len;
+		for(i=0; i<len; i++){
+			if(!mapSet(&map, lblock+i, (start+i) | FS_UNWRITTEN, &goal)) break;
+		}
+		total += i;
+		lblock += i;
+		if(i < len){
 			printf("Error: There are not enough free blocks.\n");
-			block.inode[i_offset].size = offset+bytes_written;
-			disk_write(block.inode[i_offset].indirect, indirect_block.data);
-      disk_write(block_num, block.data); 
-			return bytes_written;
-		}
-		indirect_block.pointers[j] = new_block;
-    disk_write(indirect_block.pointers[j], total_data);
-    bytes_written += ((bytes_left-bytes_written) < 4096) ? bytes_left-bytes_written : 4096;
-		strcpy(total_data, &data[bytes_written]);
-    if(bytes_written >= bytes_left) {
-			block.inode[i_offset].size = offset+bytes_written;
-			disk_write(block.inode[i_offset].indirect, indirect_block.data);
-			disk_write(block_num, block.data);
-			for(i=0;i<POINTERS_PER_BLOCK;i++){
-        if(indirect_block.pointers[i]<=0) continue;
-      }
-			return bytes_written;
+			for(; i<len; i++) freeBlock(start+i);
+			break;
 		}
-  }
+	}
+	mapDone(&map);
 
-  return bytes_written;
+	//like posix_fallocate, the file grows over whatever was reserved
+	off_t end = (lblock > last) ? offset + length : lblock << block_shift;
+	if(end > inode.size) inode.size = end;
+
+	putInode(&block, i_offset, &inode);
+	disk_write(block_num, block.data);
+	blockMapInvalidate(inumber);
+
+	return total;
+}
+
+//A file mapped into memory with fs_mmap. Each block of the file is one unit of the mapping:
+//it stays PROT_NONE until first touched, is filled from the block map and made readable,
+//and is only made writable, and so dirty, on the first write after that.
+//Each mapping decodes its own block map, so a fault never touches the shared blockmaps[],
+//whose slots a call the fault interrupted may be using.
+struct fs_mapping {
+	int inumber;
+	char *addr;
+	size_t length;
+	int64_t nblocks;
+	unsigned char *bits;
+	struct fs_blockmap blocks;	//decoded when the file's blocks move, never in the fault handler
+	struct fs_mapping *next;
+};
+
+struct fs_mapping *mappings = 0;
+static struct sigaction mmap_oldaction;
+
+int mmapLoadInode(struct fs_mapping *m, struct fs_inode *inode){
+//Read the mapping's inode as it is now; 0 if the file is gone
+	union fs_block block;
+	int g;
+	int64_t block_num;
+	int i_offset = inodeLocation(m->inumber, &g, &block_num);
+
+	if(i_offset < 0) return 0;
+	readInodeBlock(g, block_num, &block);
+	getInode(&block, i_offset, inode);
+	return inode->isvalid;
+}
+
+int mmapFlush(struct fs_mapping *m, int64_t first, int64_t last){
+//Put the mapped file's blocks first..last in the image, where the fault handler reads them without the cache
+	int64_t *blocks, b;
+	int count = 0, ok;
+
+	if(last >= m->blocks.nblocks) last = m->blocks.nblocks - 1;
+	if(first > last) return 1;
+	blocks = malloc((last - first + 1) * sizeof(int64_t));
+	if(!blocks) return 0;
+	for(b = first; b <= last; b++){
+		if(WRITTEN(m->blocks.blocks[b])) blocks[count++] = WRITTEN(m->blocks.blocks[b]);
+	}
+	ok = disk_flush_blocks(blocks, count);
+	free(blocks);
+	return ok;
+}
+
+int mmapResolve(struct fs_mapping *m){
+//Decode the file's block map afresh for the mapping; a deleted file maps nothing and reads as zeros
+	struct fs_inode inode;
+
+	free(m->blocks.blocks);
+	memset(&m->blocks, 0, sizeof(m->blocks));
+	if(!mmapLoadInode(m, &inode)) return 1;
+	return blockMapBuild(&m->blocks, m->inumber, &inode) && mmapFlush(m, 0, m->blocks.nblocks - 1);
+}
+
+void mmapRemap(int inumber){
+//Follow a file whose blocks have moved in every mapping of it
+	struct fs_mapping *m;
+	for(m = mappings; m; m = m->next){
+		if(m->inumber == inumber && !mmapResolve(m)) printf("ERROR: out of memory for the block map of inode %d\n", inumber);
+	}
+}
+
+void mmapFill(struct fs_mapping *m, int64_t b){
+//Read one block of the file straight into its page of the mapping.
+//This runs in the fault handler: no allocation, no cache and no locks, only the mapping's own map.
+	char *page = m->addr + (b << block_shift);
+	int64_t p = 0;
+
+	mprotect(page, block_size, PROT_READ|PROT_WRITE);
+	if(b < m->blocks.nblocks) p = WRITTEN(m->blocks.blocks[b]);
+
+	//holes, reservations and anything past the end read as zeros, like fs_read
+	if(!p) memset(page, 0, block_size);
+	else if(!disk_read_direct(p, page)){
+		static const char msg[] = "Error: couldn't read a mapped block from the disk image\n";
+		write(2, msg, sizeof(msg) - 1);
+		abort();
+	}
+}
+
+static void mmapFaultHandler( int signum, siginfo_t *info, void *context )
+{
+	char *addr = info->si_addr;
+	struct fs_mapping *m;
+	int saved = errno;
+
+	for(m = mappings; m; m = m->next){
+		if(addr < m->addr || addr >= m->addr + m->length) continue;
+
+		int64_t b = (addr - m->addr) >> block_shift;
+		if(!m->bits[b]){
+			mmapFill(m, b);
+			m->bits[b] = PROT_READ;
+		}
+		else m->bits[b] = PROT_READ|PROT_WRITE;
+
+		mprotect(m->addr + (b << block_shift), block_size, m->bits[b]);
+		errno = saved;
+		return;
+	}
+
+	//not ours: hand it to whoever had SIGSEGV before, or let the default action retry the access
+	errno = saved;
+	if(mmap_oldaction.sa_flags & SA_SIGINFO) mmap_oldaction.sa_sigaction(signum, info, context);
+	else if(mmap_oldaction.sa_handler != SIG_DFL && mmap_oldaction.sa_handler != SIG_IGN) mmap_oldaction.sa_handler(signum);
+	else sigaction(SIGSEGV, &mmap_oldaction, 0);
+}
+
+void mmapWriteBack(struct fs_mapping *m){
+//Write the dirty blocks of a mapping through fs_write and make them read-only again
+	struct fs_inode inode;
+	int64_t b;
+
+	if(!mmapLoadInode(m, &inode)) return;
+	off_t size = inode.size;
+
+	for(b = 0; b < m->nblocks; b++){
+		if(!(m->bits[b] & PROT_WRITE)) continue;
+
+		//a file truncated under the mapping does not grow back from it
+		off_t offset = b << block_shift;
+		if(offset < size) fs_write(m->inumber, m->addr + offset, (size-offset < block_size) ? size-offset : block_size, offset);
+
+		m->bits[b] = PROT_READ;
+		mprotect(m->addr + offset, block_size, PROT_READ);
+	}
+}
+
+void mmapSync(int inumber){
+//Write back the mappings of one file, or of every file for inode 0
+	struct fs_mapping *m;
+	for(m = mappings; m; m = m->next){
+		if(!inumber || m->inumber == inumber) mmapWriteBack(m);
+	}
+}
+
+void mmapInvalidate(int inumber, off_t offset, off_t length){
+//Drop clean mapped blocks that a write through another call has made stale; dirty ones win at write back
+	struct fs_mapping *m;
+	int64_t b, last;
+
+	if(length <= 0) return;
+	for(m = mappings; m; m = m->next){
+		if(m->inumber != inumber) continue;
+
+		last = (offset + length - 1) >> block_shift;
+		if(!mmapFlush(m, offset >> block_shift, last)) printf("ERROR: couldn't flush mapped blocks of inode %d\n", inumber);
+		if(last >= m->nblocks) last = m->nblocks - 1;
+		for(b = offset >> block_shift; b <= last; b++){
+			if(m->bits[b] != PROT_READ) continue;
+			m->bits[b] = 0;
+			mprotect(m->addr + (b << block_shift), block_size, PROT_NONE);
+		}
+	}
+}
+
+char *fs_mmap( int inumber )
+{
+	static int handler_installed = 0;
+
+	if(!fs_mounted){
+		printf("Error: the filesystem has not been mounted\n");
+		return 0;
+	}
+
+	//a block is the unit of the mapping, so it has to cover whole pages
+	if(block_size % sysconf(_SC_PAGESIZE)){
+		printf("Error: %d byte blocks are smaller than a page\n", block_size);
+		return 0;
+	}
+
+	struct fs_inode inode;
+	struct fs_mapping *m = calloc(1, sizeof(struct fs_mapping));
+	if(!m) return 0;
+	m->inumber = inumber;
+	if(!mmapLoadInode(m, &inode)){
+		printf("Error: inode %d is not valid\n", inumber);
+		free(m);
+		return 0;
+	}
+	if(!inode.size || inode.size > SIZE_MAX){
+		printf("Error: inode %d cannot be mapped at %lld bytes\n", inumber, (long long)inode.size);
+		free(m);
+		return 0;
+	}
+
+	m->nblocks = (inode.size + block_size - 1) >> block_shift;
+	m->length = m->nblocks << block_shift;
+	m->bits = calloc(m->nblocks, 1);
+	m->addr = mmap(0, m->length, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if(!m->bits || m->addr == MAP_FAILED || !mmapResolve(m)){
+		printf("Error: couldn't map inode %d: %s\n", inumber, strerror(errno));
+		if(m->addr != MAP_FAILED) munmap(m->addr, m->length);
+		free(m->blocks.blocks);
+		free(m->bits);
+		free(m);
+		return 0;
+	}
+
+	if(!handler_installed){
+		struct sigaction sa;
+		sa.sa_sigaction = mmapFaultHandler;
+		sa.sa_flags = SA_SIGINFO;
+		sigfillset( &sa.sa_mask );
+		sigaction( SIGSEGV, &sa, &mmap_oldaction );
+		handler_installed = 1;
+	}
+
+	m->next = mappings;
+	mappings = m;
+	return m->addr;
+}
+
+int fs_munmap( char *addr )
+{
+	struct fs_mapping **prev, *m;
+
+	for(prev = &mappings; (m = *prev); prev = &m->next){
+		if(m->addr != addr) continue;
+
+		mmapWriteBack(m);
+		*prev = m->next;
+		munmap(m->addr, m->length);
+		free(m->blocks.blocks);
+		free(m->bits);
+		free(m);
+		return 1;
+	}
+
+	printf("Error: %p is not a mapped file\n", addr);
+	return 0;
+}
+
+int fs_sync()
+{
+	if(!fs_mounted){
+		printf("There is no mounted disk\n");
+		return 0;
+	}
+	mmapSync(0);
+	return disk_sync();
+}
+
+struct fs_block_list {
+	int64_t *blocks;
+	int count;
+	int size;
+};
+
+int addBlock(struct fs_block_list *list, int64_t blocknum){
+	if(list->count == list->size){
+		int size = list->size ? list->size*2 : 64;
+		int64_t *blocks = realloc(list->blocks, size * sizeof(int64_t));
+		if(!blocks) return 0;
+		list->blocks = blocks;
+		list->size = size;
+	}
+	list->blocks[list->count++] = blocknum;
+	return 1;
+}
+
+int listTree(struct fs_block_list *list, int64_t blocknum, int depth){
+//Add a pointer block and the written blocks under it
+	union fs_block block;
+	int i;
+
+	if(!addBlock(list, blocknum)) return 0;
+	disk_read(blocknum, block.data);
+	for(i=0; i<pointers_per_block; i++){
+		int64_t p = getPointer(&block, i);
+		if(!WRITTEN(p)) continue;
+		if(!(depth > 1 ? listTree(list, p, depth-1) : addBlock(list, p))) return 0;
+	}
+	return 1;
+}
+
+int listBlocks(struct fs_block_list *list, const struct fs_inode *inode){
+//Add a file's written blocks and the pointer blocks over them
+	int i, ok = 1;
+
+	for(i=0; ok && i<direct_pointers; i++){
+		if(WRITTEN(inode->direct[i])) ok = addBlock(list, inode->direct[i]);
+	}
+	for(i=0; ok && i<indirect_levels; i++){
+		if(inode->indirect[i]) ok = listTree(list, inode->indirect[i], i+1);
+	}
+	return ok;
+}
+
+int fs_fsync( int inumber )
+{
+	if(!fs_mounted){
+		printf("There is no mounted disk\n");
+		return 0;
+	}
+
+	//dirty mapped blocks have to reach the file before its blocks are collected
+	mmapSync(inumber);
+	int g;
+	int64_t block_num;
+	int i_offset = inodeLocation(inumber, &g, &block_num);
+	if(i_offset < 0) {
+		printf("Error: enter a valid inode value\n");
+		return 0;
+	}
+
+	union fs_block block;
+	struct fs_inode inode;
+	readInodeBlock(g, block_num, &block);
+	getInode(&block, i_offset, &inode);
+	if(!inode.isvalid){
+		printf("Error: inode %d is not valid\n", inumber);
+		return 0;
+	}
+
+	//the superblock comes along since it records how much of the inode table is in use
+	struct fs_block_list list = { 0, 0, 0 };
+	int ok = addBlock(&list, 0) && addBlock(&list, block_num) && listBlocks(&list, &inode);
+
+	if(ok) ok = disk_sync_blocks(list.blocks, list.count);
+	free(list.blocks);
+	return ok;
+}
+
+int64_t fs_trim()
+{
+	if(!fs_mounted){
+		printf("There is no mounted disk\n");
+		return -1;
+	}
+
+	int g;
+	int64_t i, start, total = 0;
+	for(g=0; g<ngroups; g++){
+		for(i=dataStart(g); i<groups[g].end; i++){
+			if(free_bitmap[i]) continue;
+
+			//Discard the whole run of free blocks at once
+			start = i;
+			while(i<groups[g].end && !free_bitmap[i]) i++;
+			disk_discard(start, i-start);
+			total += i-start;
+		}
+	}
+
+	disk_discard_flush();
+	return total;
+}
+
+//The allocated blocks of a file, in logical order
+struct fs_extent_list {
+	int64_t *lblock;
+	int64_t *pblock;
+	int64_t count;
+	int64_t size;
+};
+
+int addExtentBlock(struct fs_extent_list *list, int64_t lblock, int64_t pblock){
+	if(list->count == list->size){
+		int64_t size = list->size ? list->size*2 : 1024;
+		int64_t *l = realloc(list->lblock, size * sizeof(int64_t));
+		if(l) list->lblock = l;
+		int64_t *p = realloc(list->pblock, size * sizeof(int64_t));
+		if(p) list->pblock = p;
+		if(!l || !p) return 0;
+		list->size = size;
+	}
+	list->lblock[list->count] = lblock;
+	list->pblock[list->count++] = pblock;
+	return 1;
+}
+
+int collectTree(struct fs_extent_list *list, int64_t blocknum, int depth, int64_t base){
+	union fs_block block;
+	int64_t span = levelSpan(depth);
+	int i;
+
+	disk_read(blocknum, block.data);
+	for(i = 0; i < pointers_per_block; i++){
+		int64_t p = getPointer(&block, i);
+		if(!p) continue;
+		if(!(depth == 1 ? addExtentBlock(list, base + i, p) : collectTree(list, p, depth-1, base + i*span))) return 0;
+	}
+	return 1;
+}
+
+int collectBlocks(const struct fs_inode *inode, struct fs_extent_list *list){
+	int64_t i, base = direct_pointers;
+	int d;
+
+	for(i = 0; i < direct_pointers; i++){
+		if(inode->direct[i] && !addExtentBlock(list, i, inode->direct[i])) return 0;
+	}
+	for(d = 1; d <= indirect_levels; d++){
+		if(inode->indirect[d-1] && !collectTree(list, inode->indirect[d-1], d, base)) return 0;
+		base += levelSpan(d+1);
+	}
+	return 1;
+}
+
+int64_t countExtents(const struct fs_extent_list *list){
+//Physical runs of the file's data; holes in the file do not split a run
+	int64_t i, extents = 0;
+	for(i = 0; i < list->count; i++){
+		if(!i || BLOCKNUM(list->pblock[i]) != BLOCKNUM(list->pblock[i-1]) + 1) extents++;
+	}
+	return extents;
+}
+
+int64_t longestRun(int64_t want, int64_t *len){
+//Allocate the first free run of want blocks anywhere on the disk, else the longest shorter one
+	int g, best = -1;
+	int64_t start, l, beststart = 0;
+	*len = 0;
+
+	for(g = 0; g < ngroups && *len < want; g++){
+		start = runInGroup(g, 0, want, &l);
+		if(start && l > *len){
+			best = g;
+			beststart = start;
+			*len = l;
+		}
+	}
+	if(best < 0) return 0;
+
+	for(start = beststart; start < beststart + *len; start++) free_bitmap[start] = 1;
+	groups[best].nfree -= *len;
+	return beststart;
+}
+
+void releaseRun(int64_t start, int64_t len){
+//Give back blocks that were allocated but never written
+	int64_t i;
+	for(i = start; i < start + len; i++) free_bitmap[i] = 0;
+	groups[blockGroup(start)].nfree += len;
+}
+
+int defragInode(int inumber, int64_t *before){
+//Move a fragmented file into fewer, larger runs; 1 if it moved, 0 if it was left alone, -1 on error
+	int g;
+	int64_t block_num;
+	int i_offset = inodeLocation(inumber, &g, &block_num);
+	union fs_block block;
+	struct fs_inode inode, moved;
+	struct fs_extent_list list = { 0, 0, 0, 0 };
+	int64_t *dest = 0, *runs = 0;
+	int64_t i, n, r, len, start, nruns = 0, got = 0;
+	char *buffer = 0;
+	int result = -1;
+
+	readInodeBlock(g, block_num, &block);
+	getInode(&block, i_offset, &inode);
+	if(!inode.isvalid) return 0;
+
+	if(!collectBlocks(&inode, &list)) goto done;
+	*before = countExtents(&list);
+	result = 0;
+	if(*before <= 1) goto done;
+
+	//take the longest free runs until the file fits; moving only pays if it ends up in fewer pieces
+	result = -1;
+	dest = malloc(list.count * sizeof(int64_t));
+	runs = malloc(2 * (*before) * sizeof(int64_t));
+	buffer = malloc(FS_DEFRAG_BATCH);
+	if(!dest || !runs || !buffer) goto done;
+	result = 0;
+
+	while(got < list.count && nruns < *before - 1){
+		start = longestRun(list.count - got, &len);
+		if(!start) break;
+		for(i = 0; i < len; i++) dest[got + i] = start + i;
+		runs[2*nruns] = start;
+		runs[2*nruns+1] = len;
+		nruns++;
+		got += len;
+	}
+	if(got < list.count){
+		for(r = 0; r < nruns; r++) releaseRun(runs[2*r], runs[2*r+1]);
+		goto done;
+	}
+
+	//copy in large batches wherever both sides are contiguous; reserved blocks have nothing to copy
+	int batch = FS_DEFRAG_BATCH / block_size;
+	for(i = 0; i < list.count; i += n){
+		int64_t src = list.pblock[i];
+		n = 1;
+		if(src & FS_UNWRITTEN) continue;
+		while(i + n < list.count && n < batch && list.pblock[i+n] == src + n && dest[i+n] == dest[i] + n) n++;
+		disk_read_range(src, n, buffer);
+		disk_write_range(dest[i], n, buffer);
+	}
+
+	//the new tree is built beside the old one, with its pointer blocks after the last run
+	struct fs_map map;
+	int64_t goal = dest[list.count-1] + 1;
+	moved = inode;
+	memset(moved.direct, 0, sizeof(moved.direct));
+	memset(moved.indirect, 0, sizeof(moved.indirect));
+	mapInit(&map, &moved);
+	for(i = 0; i < list.count; i++){
+		if(!mapSet(&map, list.lblock[i], dest[i] | (list.pblock[i] & FS_UNWRITTEN), &goal)) break;
+	}
+	mapDone(&map);
+	if(i < list.count){
+		//out of room for pointer blocks: drop the copy, the file keeps its old blocks
+		for(; i < list.count; i++) freeBlock(dest[i]);
+		truncateBlocks(&moved, 0);
+		goto done;
+	}
+
+	//the copy and its new pointer blocks are on disk before the inode points at them,
+	//so a crash leaves one layout or the other; nothing else in the cache has to go with them
+	struct fs_block_list copied = { 0, 0, 0 };
+	int synced = listBlocks(&copied, &moved) && disk_sync_blocks(copied.blocks, copied.count);
+	free(copied.blocks);
+	if(!synced){
+		truncateBlocks(&moved, 0);
+		result = -1;
+		goto done;
+	}
+	putInode(&block, i_offset, &moved);
+	disk_write(block_num, block.data);
+
+	//only now can the old blocks go; mapped blocks keep their contents but not their places
+	truncateBlocks(&inode, 0);
+	blockMapInvalidate(inumber);
+	mmapRemap(inumber);
+	result = 1;
+
+done:
+	free(list.lblock);
+	free(list.pblock);
+	free(dest);
+	free(runs);
+	free(buffer);
+	return result;
+}
+
+int64_t fs_defrag( int inumber )
+{
+	if(!fs_mounted){
+		printf("There is no mounted disk\n");
+		return -1;
+	}
+
+	int64_t before = 0, extents = 0, files = 0;
+	int r;
+
+	if(inumber){
+		int g;
+		int64_t block_num;
+		if(inodeLocation(inumber, &g, &block_num) < 0){
+			printf("Error: enter a valid inode value\n");
+			return -1;
+		}
+		r = defragInode(inumber, &before);
+		if(r < 0) return -1;
+		if(r) printf("inode %d: %lld extents moved\n", inumber, (long long)before);
+		return r;
+	}
+
+	//every file in every group with more than one extent
+	int g, j;
+	int64_t i;
+	union fs_block block;
+	struct fs_inode inode;
+	for(g = 0; g < ngroups; g++){
+		for(i = groups[g].inode_table; inodeBlockInitialized(g, i); i++){
+			disk_read(i, block.data);
+			for(j = 0; j < inodes_per_block; j++){
+				getInode(&block, j, &inode);
+				if(!inode.isvalid) continue;
+
+				r = defragInode(inodeNumber(g, i, j), &before);
+				if(r < 0) return -1;
+				if(r){
+					files++;
+					extents += before;
+				}
+			}
+		}
+	}
+	if(files) printf("%lld files in %lld extents moved\n", (long long)files, (long long)extents);
+	return files;
+}
+
+int upgradeInode(struct fs_inode *inode){
+//Rebuild a revision 0 inode's block tree in the revision 1 layout; the data blocks stay where they are
+	union fs_block block;
+	struct fs_map map;
+	int64_t i, nblocks, goal = 0;
+	int ok = 1;
+
+	setRevision(0);
+	nblocks = direct_pointers + pointers_per_block;
+	int64_t *blocks = calloc(nblocks, sizeof(int64_t));
+	if(!blocks) return 0;
+
+	for(i=0; i<direct_pointers; i++) blocks[i] = inode->direct[i];
+	if(inode->indirect[0]){
+		disk_read(inode->indirect[0], block.data);
+		for(i=0; i<pointers_per_block; i++) blocks[direct_pointers+i] = getPointer(&block, i);
+	}
+
+	//the new pointer blocks go next to the file's first data
+	setRevision(FS_REVISION);
+	memset(inode->direct, 0, sizeof(inode->direct));
+	memset(inode->indirect, 0, sizeof(inode->indirect));
+	mapInit(&map, inode);
+	for(i=0; ok && i<nblocks; i++){
+		if(!blocks[i]) continue;
+		if(!goal) goal = BLOCKNUM(blocks[i]);
+		ok = mapSet(&map, i, blocks[i], &goal);
+	}
+	mapDone(&map);
+
+	free(blocks);
+	return ok;
+}
+
+int fs_upgrade()
+{
+	if(!fs_mounted){
+		printf("There is no mounted disk\n");
+		return 0;
+	}
+	if(revision){
+		printf("the disk is already at revision %d\n", revision);
+		return 1;
+	}
+	if(ngroups > FS_MAX_GROUPS64){
+		printf("Error: %d block groups do not fit in a revision %d superblock\n", ngroups, FS_REVISION);
+		return 0;
+	}
+
+	//Inodes double in size, so each group's table does too and inode numbers stay the same
+	int per32 = block_size / sizeof(struct fs_inode32), per64 = block_size / sizeof(struct fs_inode64);
+	int64_t ipg = inodeblocks_per_group, new_ipg = 2*ipg, i, len;
+	int g, j, ok = 1;
+
+	int64_t *tables = calloc(ngroups, sizeof(int64_t));
+	if(!tables) return 0;
+
+	//The new tables go into free space, so the old layout stays intact until the superblock changes
+	for(g=0; ok && g<ngroups; g++){
+		tables[g] = allocRun(groups[g].start, new_ipg, &len);
+		if(!tables[g] || len < new_ipg){
+			printf("Error: not enough contiguous free space for the new inode tables\n");
+			ok = 0;
+		}
+	}
+
+	union fs_block block, half[2];
+	struct fs_inode inode;
+	for(g=0; ok && g<ngroups; g++){
+		for(i=0; ok && i<ipg-groups[g].itable_unused; i++){
+			disk_read(groups[g].inode_table + i, block.data);
+			memset(half[0].data, 0, block_size);
+			memset(half[1].data, 0, block_size);
+
+			for(j=0; ok && j<per32; j++){
+				setRevision(0);
+				getInode(&block, j, &inode);
+				if(!inode.isvalid) continue;
+
+				if(!(ok = upgradeInode(&inode))) printf("Error: There are not enough free blocks.\n");
+				putInode(&half[j / per64], j % per64, &inode);
+			}
+
+			disk_write(tables[g] + 2*i, half[0].data);
+			disk_write(tables[g] + 2*i + 1, half[1].data);
+		}
+	}
+	setRevision(FS_REVISION);
+
+	//Everything the new superblock points at has to be on disk before it is
+	if(ok && !disk_sync()) ok = 0;
+	if(!ok){
+		free(tables);
+		fs_mounted = 0;
+		fs_mount();
+		return 0;
+	}
+
+	memset(block.data, 0, block_size);
+	block.super64.magic = FS_MAGIC64;
+	block.super64.revision = FS_REVISION;
+	block.super64.block_size = block_size;
+	block.super64.ngroups = ngroups;
+	block.super64.nblocks = fs_nblocks;
+	block.super64.ninodeblocks = ngroups*new_ipg;
+	block.super64.ninodes = ngroups*new_ipg*per64;
+	block.super64.blocks_per_group = blocks_per_group;
+	block.super64.inodeblocks_per_group = new_ipg;
+	for(g=0; g<ngroups; g++){
+		block.super64.groups[g].inode_table = tables[g];
+		block.super64.groups[g].itable_unused = 2*groups[g].itable_unused;
+	}
+	free(tables);
+
+	disk_write(0, block.data);
+	disk_sync();
+
+	//The old tables and indirect blocks are not referenced any more and come back as free space
+	fs_mounted = 0;
+	return fs_mount();
 }
@@ -1,15 +1,35 @@
 #ifndef FS_H
 #define FS_H
 
+#include <sys/types.h>
+#include <stdint.h>
+
 void fs_debug();
-int  fs_format();
+int  fs_stats( int json );
+int  fs_format( int block_size );
 int  fs_mount();
+int  fs_upgrade();
 
 int  fs_create();
 int  fs_delete( int inumber );
-int  fs_getsize();
+off_t fs_getsize( int inumber );
+
+int  fs_read( int inumber, char *data, int length, off_t offset );
+int  fs_write( int inumber, const char *data, int length, off_t offset );
+
+off_t fs_import( int inumber, const char *filename );
+off_t fs_export( int inumber, const char *filename );
+
+off_t fs_truncate( int inumber, off_t size );
+int64_t fs_fallocate( int inumber, off_t offset, off_t length );
+
+int64_t fs_trim();
+int64_t fs_defrag( int inumber );
+
+int  fs_sync();
+int  fs_fsync( int inumber );
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+char *fs_mmap( int inumber );
+int  fs_munmap( char *addr );
 
 #endif
\ No newline at end of file
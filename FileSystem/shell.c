@@ -1,6 +1,7 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,22 +17,49 @@ int main( int argc, char *argv[] )
 	char cmd[1024];
 	char arg1[1024];
 	char arg2[1024];
-	int inumber, result, args;
+	char arg3[1024];
+	int inumber, args;
+	long long size;
+	const char *images[DISK_MAX_DEVICES];
+	char imagelist[1024];
+	int nimages = 0;
+	int batch = 0;
+	const char *program = argv[0];
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	//Batch mode leaves out the prompt, for scripts feeding commands on stdin
+	if(argc>1 && !strcmp(argv[1],"-b")) {
+		batch = 1;
+		argv++;
+		argc--;
+	}
+
+	if(argc!=3 && argc!=4) {
+		printf("use: %s [-b] <diskfile>[,<diskfile>...] <nblocks> [stripeunit]\n",program);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	//A comma separated list of images is striped across all of them
+	strncpy(imagelist,argv[1],sizeof(imagelist)-1);
+	imagelist[sizeof(imagelist)-1] = 0;
+	char *name = strtok(imagelist,",");
+	while(name && nimages<DISK_MAX_DEVICES) {
+		images[nimages++] = name;
+		name = strtok(0,",");
+	}
+	if(!nimages || name) {
+		printf("use: at most %d disk images\n",DISK_MAX_DEVICES);
+		return 1;
+	}
+
+	if(!disk_init_striped(images,nimages,atoll(argv[2]),argc==4 ? atoi(argv[3]) : DISK_STRIPE_UNIT)) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	printf("opened emulated disk image %s with %lld blocks\n",argv[1],(long long)disk_size());
 
 	while(1) {
-		printf(" simplefs> ");
+		if(!batch) printf(" simplefs> ");
 		fflush(stdout);
 
 		if(!fgets(line,sizeof(line),stdin)) break;
@@ -39,18 +67,18 @@ int main( int argc, char *argv[] )
 		if(line[0]=='\n') continue;
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+		args = sscanf(line,"%s %s %s %s",cmd,arg1,arg2,arg3);
 		if(args==0) continue;
 
 		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
+			if(args==1 || args==2) {
+				if(fs_format(args==2 ? atoi(arg1) : DISK_BLOCK_SIZE)) {
 					printf("disk formatted.\n");
 				} else {
 					printf("format failed!\n");
 				}
 			} else {
-				printf("use: format\n");
+				printf("use: format [blocksize]\n");
 			}
 		} else if(!strcmp(cmd,"mount")) {
 			if(args==1) {
@@ -68,12 +96,20 @@ int main( int argc, char *argv[] )
 			} else {
 				printf("use: debug\n");
 			}
+		} else if(!strcmp(cmd,"stats")) {
+			if(args==1 || (args==2 && !strcmp(arg1,"json"))) {
+				if(!fs_stats(args==2)) {
+					printf("stats failed!\n");
+				}
+			} else {
+				printf("use: stats [json]\n");
+			}
 		} else if(!strcmp(cmd,"getsize")) {
 			if(args==2) {
 				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
-				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
+				size = fs_getsize(inumber);
+				if(size>=0) {
+					printf("inode %d has size %lld\n",inumber,size);
 				} else {
 					printf("getsize failed!\n");
 				}
@@ -137,16 +173,118 @@ int main( int argc, char *argv[] )
 				printf("use: copyout <inumber> <filename>\n");
 			}
 
+		} else if(!strcmp(cmd,"truncate")) {
+			if(args==3) {
+				inumber = atoi(arg1);
+				size = fs_truncate(inumber,atoll(arg2));
+				if(size>=0) {
+					printf("inode %d truncated to %lld bytes\n",inumber,size);
+				} else {
+					printf("truncate failed!\n");
+				}
+			} else {
+				printf("use: truncate <inode> <size>\n");
+			}
+
+		} else if(!strcmp(cmd,"fallocate")) {
+			if(args==4) {
+				inumber = atoi(arg1);
+				size = fs_fallocate(inumber,atoll(arg2),atoll(arg3));
+				if(size>=0) {
+					printf("%lld blocks reserved for inode %d\n",size,inumber);
+				} else {
+					printf("fallocate failed!\n");
+				}
+			} else {
+				printf("use: fallocate <inode> <offset> <length>\n");
+			}
+
+		} else if(!strcmp(cmd,"trim")) {
+			if(args==1) {
+				size = fs_trim();
+				if(size>=0) {
+					printf("%lld free blocks trimmed.\n",size);
+				} else {
+					printf("trim failed!\n");
+				}
+			} else {
+				printf("use: trim\n");
+			}
+
+		} else if(!strcmp(cmd,"defrag")) {
+			if(args==1 || args==2) {
+				size = fs_defrag(args==2 ? atoi(arg1) : 0);
+				if(size>=0) {
+					printf("%lld files defragmented.\n",size);
+				} else {
+					printf("defrag failed!\n");
+				}
+			} else {
+				printf("use: defrag [inode]\n");
+			}
+
+		} else if(!strcmp(cmd,"sync")) {
+			if(args==1) {
+				if(fs_sync()) {
+					printf("disk synced.\n");
+				} else {
+					printf("sync failed!\n");
+				}
+			} else {
+				printf("use: sync\n");
+			}
+
+		} else if(!strcmp(cmd,"fsync")) {
+			if(args==2) {
+				inumber = atoi(arg1);
+				if(fs_fsync(inumber)) {
+					printf("inode %d synced.\n",inumber);
+				} else {
+					printf("fsync failed!\n");
+				}
+			} else {
+				printf("use: fsync <inode>\n");
+			}
+
+		} else if(!strcmp(cmd,"replay")) {
+			if(args>=2 && (args==2 || !strcmp(arg2,"fast") || !strcmp(arg2,"timed"))) {
+				if(trace_replay(arg1,args>=3 && !strcmp(arg2,"timed"),args==4 ? arg3 : 0)<0) {
+					printf("replay failed!\n");
+				}
+			} else {
+				printf("use: replay <tracefile> [fast|timed] [latencyfile]\n");
+			}
+
+		} else if(!strcmp(cmd,"upgrade")) {
+			if(args==1) {
+				if(fs_upgrade()) {
+					printf("disk upgraded.\n");
+				} else {
+					printf("upgrade failed!\n");
+				}
+			} else {
+				printf("use: upgrade\n");
+			}
+
 		} else if(!strcmp(cmd,"help")) {
 			printf("Commands are:\n");
-			printf("    format\n");
+			printf("    format  [blocksize]\n");
 			printf("    mount\n");
 			printf("    debug\n");
+			printf("    stats   [json]\n");
 			printf("    create\n");
 			printf("    delete  <inode>\n");
 			printf("    cat     <inode>\n");
 			printf("    copyin  <file> <inode>\n");
 			printf("    copyout <inode> <file>\n");
+			printf("    truncate  <inode> <size>\n");
+			printf("    fallocate <inode> <offset> <length>\n");
+			printf("    trim\n");
+			printf("    defrag  [inode]\n");
+			printf("    sync\n");
+			printf("    fsync   <inode>\n");
+			printf("    upgrade\n");
+			printf("    replay  <tracefile> [fast|timed] [latencyfile]\n");
 			printf("    help\n");
 			printf("    quit\n");
 			printf("    exit\n");
@@ -157,7 +295,6 @@ int main( int argc, char *argv[] )
 		} else {
 			printf("unknown command: %s\n",cmd);
 			printf("type 'help' for a list of commands.\n");
-			result = 1;
 		}
 	}
 
@@ -169,60 +306,19 @@ int main( int argc, char *argv[] )
 
 static int do_copyin( const char *filename, int inumber )
 {
-	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
-
-	file = fopen(filename,"r");
-	if(!file) {
-		printf("couldn't open %s: %s\n",filename,strerror(errno));
-		return 0;
-	}
+	//The bulk import sizes the file once and copies it in large runs
+	long long result = fs_import(inumber,filename);
+	if(result<0) return 0;
 
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
-		if(result<=0) break;
-		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
-			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
-				break;
-			}
-			offset += actual;
-			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
-				break;
-			}
-		}
-	}
-
-	printf("%d bytes copied\n",offset);
-
-	fclose(file);
+	printf("%lld bytes copied\n",result);
 	return 1;
 }
 
 static int do_copyout( int inumber, const char *filename )
 {
-	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
-
-	file = fopen(filename,"w");
-	if(!file) {
-		printf("couldn't open %s: %s\n",filename,strerror(errno));
-		return 0;
-	}
-
-	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file);
-		offset += result;
-	}
-
-	printf("%d bytes copied\n",offset);
+	long long result = fs_export(inumber,filename);
+	if(result<0) return 0;
 
-	fclose(file);
+	printf("%lld bytes copied\n",result);
 	return 1;
 }
@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+
+#include "fs.h"
+#include "disk.h"
+#include "simplefsd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SFSD_MAX_CLIENTS 256
+#define SFSD_READ_CHUNK  (256 << 10)
+#define SFSD_OUTPUT_HIGH (4 * SFSD_MAX_IO)	//stop taking requests from a client this far behind
+
+//A connection with the bytes received but not yet handled, and the answers not yet sent
+struct sfsd_client {
+	int fd;
+	char *in;
+	size_t inlen;
+	size_t insize;
+	char *out;
+	size_t outstart;
+	size_t outlen;
+	size_t outsize;
+	int closing;
+};
+
+static struct sfsd_client clients[SFSD_MAX_CLIENTS];
+static int nclients = 0;
+static volatile sig_atomic_t stopping = 0;
+
+static void handle_stop( int sig )
+{
+	stopping = 1;
+}
+
+static int reserve( char **buffer, size_t *size, size_t needed )
+{
+	if(needed<=*size) return 1;
+
+	size_t size2 = *size ? *size : 4096;
+	while(size2<needed) size2 *= 2;
+	char *grown = realloc(*buffer,size2);
+	if(!grown) return 0;
+	*buffer = grown;
+	*size = size2;
+	return 1;
+}
+
+static char *add_response( struct sfsd_client *c, const struct sfsd_request *req, int64_t result, size_t datalen )
+{
+//Queue an answer, returning where its datalen bytes of data go
+	struct sfsd_response resp;
+
+	//answers already sent are dropped from the front before the buffer grows
+	if(c->outstart && c->outstart==c->outlen) c->outstart = c->outlen = 0;
+	if(!reserve(&c->out,&c->outsize,c->outlen+sizeof(resp)+datalen)) return 0;
+
+	resp.magic = SFSD_MAGIC;
+	resp.op = req->op;
+	resp.tag = req->tag;
+	resp.result = result;
+	memcpy(c->out+c->outlen,&resp,sizeof(resp));
+	c->outlen += sizeof(resp);
+
+	char *data = c->out+c->outlen;
+	c->outlen += datalen;
+	return data;
+}
+
+static size_t request_size( const struct sfsd_request *req )
+{
+	return sizeof(*req) + (req->op==SFSD_WRITE ? req->length : 0);
+}
+
+static int handle_request( struct sfsd_client *c, const struct sfsd_request *req, const char *data )
+{
+//Run one request against the mounted filesystem and queue its answer; 0 if the client has to go
+	int64_t result = -1;
+	struct sfsd_response *resp;
+	size_t at;
+	char *out;
+
+	switch(req->op) {
+		case SFSD_CREATE:
+			result = fs_create();
+			break;
+		case SFSD_DELETE:
+			result = fs_delete(req->inumber);
+			break;
+		case SFSD_GETSIZE:
+			result = fs_getsize(req->inumber);
+			break;
+		case SFSD_READ:
+			//the data is read straight into the answer, which is then cut to what was there
+			at = c->outlen;
+			out = add_response(c,req,0,req->length);
+			if(!out) return 0;
+			result = fs_read(req->inumber,out,req->length,req->offset);
+			c->outlen -= req->length - result;
+			resp = (struct sfsd_response *)(c->out+at);
+			resp->result = result;
+			return 1;
+		case SFSD_WRITE:
+			result = fs_write(req->inumber,data,req->length,req->offset);
+			break;
+		case SFSD_TRUNCATE:
+			result = fs_truncate(req->inumber,req->offset);
+			break;
+		case SFSD_FSYNC:
+			result = fs_fsync(req->inumber);
+			break;
+		case SFSD_SYNC:
+			result = fs_sync();
+			break;
+	}
+
+	return add_response(c,req,result,0)!=0;
+}
+
+static int handle_input( struct sfsd_client *c )
+{
+//Run every complete request in the input buffer, in order; 0 if the client has to go
+	size_t used = 0;
+
+	while(c->inlen-used>=sizeof(struct sfsd_request)) {
+		struct sfsd_request req;
+		memcpy(&req,c->in+used,sizeof(req));
+
+		//a stream that has lost its framing cannot be resynchronized
+		if(req.magic!=SFSD_MAGIC || req.op<SFSD_CREATE || req.op>SFSD_SYNC || req.length>SFSD_MAX_IO) {
+			printf("simplefsd: malformed request on connection %d\n",c->fd);
+			return 0;
+		}
+		if(c->inlen-used<request_size(&req)) break;
+
+		if(!handle_request(c,&req,c->in+used+sizeof(req))) return 0;
+		used += request_size(&req);
+
+		//a client that is not reading its answers waits until it catches up
+		if(c->outlen-c->outstart>SFSD_OUTPUT_HIGH) break;
+	}
+
+	memmove(c->in,c->in+used,c->inlen-used);
+	c->inlen -= used;
+	return 1;
+}
+
+static void drop_client( int i )
+{
+	close(clients[i].fd);
+	free(clients[i].in);
+	free(clients[i].out);
+	clients[i] = clients[--nclients];
+}
+
+static int open_socket( const char *path )
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(strlen(path)>=sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = socket(AF_UNIX,SOCK_STREAM,0);
+	if(fd<0) return -1;
+
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path,path);
+
+	//a socket left behind by an earlier run is replaced
+	unlink(path);
+	if(bind(fd,(struct sockaddr*)&addr,sizeof(addr))<0 || listen(fd,64)<0) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd,F_SETFL,O_NONBLOCK);
+	return fd;
+}
+
+int main( int argc, char *argv[] )
+{
+	struct pollfd fds[SFSD_MAX_CLIENTS+1];
+	const char *images[DISK_MAX_DEVICES];
+	char imagelist[1024];
+	int nimages = 0;
+	int i, n, listener;
+
+	if(argc!=4 && argc!=5) {
+		printf("use: %s <diskfile>[,<diskfile>...] <nblocks> <socket> [stripeunit]\n",argv[0]);
+		return 1;
+	}
+
+	strncpy(imagelist,argv[1],sizeof(imagelist)-1);
+	imagelist[sizeof(imagelist)-1] = 0;
+	char *name = strtok(imagelist,",");
+	while(name && nimages<DISK_MAX_DEVICES) {
+		images[nimages++] = name;
+		name = strtok(0,",");
+	}
+	if(!nimages || name) {
+		printf("use: at most %d disk images\n",DISK_MAX_DEVICES);
+		return 1;
+	}
+
+	if(!disk_init_striped(images,nimages,atoll(argv[2]),argc==5 ? atoi(argv[4]) : DISK_STRIPE_UNIT)) {
+		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
+		return 1;
+	}
+
+	//the image is mounted once, and every client shares the mount and the block cache
+	if(!fs_mount()) {
+		printf("couldn't mount %s\n",argv[1]);
+		disk_close();
+		return 1;
+	}
+
+	listener = open_socket(argv[3]);
+	if(listener<0) {
+		printf("couldn't listen on %s: %s\n",argv[3],strerror(errno));
+		disk_close();
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa,0,sizeof(sa));
+	sa.sa_handler = handle_stop;
+	sigaction(SIGINT,&sa,0);
+	sigaction(SIGTERM,&sa,0);
+	signal(SIGPIPE,SIG_IGN);
+
+	printf("simplefsd: serving %s on %s\n",argv[1],argv[3]);
+	fflush(stdout);
+
+	while(!stopping) {
+		fds[0].fd = listener;
+		fds[0].events = (nclients<SFSD_MAX_CLIENTS) ? POLLIN : 0;
+		for(i=0;i<nclients;i++) {
+			struct sfsd_client *c = &clients[i];
+			fds[i+1].fd = c->fd;
+			fds[i+1].events = 0;
+			if(!c->closing && c->outlen-c->outstart<=SFSD_OUTPUT_HIGH) fds[i+1].events |= POLLIN;
+			if(c->outlen>c->outstart) fds[i+1].events |= POLLOUT;
+		}
+
+		n = poll(fds,nclients+1,-1);
+		if(n<0) {
+			if(errno==EINTR) continue;
+			printf("simplefsd: poll failed: %s\n",strerror(errno));
+			break;
+		}
+
+		//clients are walked backwards, since dropping one moves the last into its place
+		for(i=nclients-1;i>=0;i--) {
+			struct sfsd_client *c = &clients[i];
+			short revents = fds[i+1].revents;
+			int ok = 1;
+
+			if(revents & (POLLIN|POLLHUP|POLLERR)) {
+				if(!reserve(&c->in,&c->insize,c->inlen+SFSD_READ_CHUNK)) ok = 0;
+				ssize_t got = ok ? read(c->fd,c->in+c->inlen,SFSD_READ_CHUNK) : -1;
+				if(got>0) c->inlen += got;
+				else if(got==0) c->closing = 1;
+				else if(errno!=EAGAIN && errno!=EINTR) ok = 0;
+			}
+
+			//requests are also picked up here once a stalled client drains its answers
+			if(ok) ok = handle_input(c);
+
+			if(ok && c->outlen>c->outstart) {
+				ssize_t put = write(c->fd,c->out+c->outstart,c->outlen-c->outstart);
+				if(put>0) c->outstart += put;
+				else if(put<0 && errno!=EAGAIN && errno!=EINTR) ok = 0;
+			}
+			if(c->outstart==c->outlen) c->outstart = c->outlen = 0;
+
+			if(!ok || (c->closing && c->outlen==c->outstart)) drop_client(i);
+		}
+
+		if(fds[0].revents & POLLIN) {
+			int fd;
+			while(nclients<SFSD_MAX_CLIENTS && (fd = accept(listener,0,0))>=0) {
+				fcntl(fd,F_SETFL,O_NONBLOCK);
+				memset(&clients[nclients],0,sizeof(clients[nclients]));
+				clients[nclients++].fd = fd;
+			}
+		}
+	}
+
+	printf("simplefsd: shutting down\n");
+	while(nclients) drop_client(nclients-1);
+	close(listener);
+	unlink(argv[3]);
+	fs_sync();
+	disk_close();
+	return 0;
+}
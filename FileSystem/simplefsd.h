@@ -0,0 +1,50 @@
+#ifndef SIMPLEFSD_H
+#define SIMPLEFSD_H
+
+#include <stdint.h>
+
+/*
+Wire protocol of simplefsd, in host byte order over a Unix domain socket.
+
+A client sends requests back to back without waiting for answers. Each
+is a struct sfsd_request, followed by length bytes of data for a write.
+The server answers every request, in the order it arrived, with a
+struct sfsd_response and, for a read, result bytes of data. The tag is
+echoed back so a client can match answers to requests.
+
+result is what the matching fs_ call returned: an inode number for
+create, a size or byte count for getsize, read, write and truncate,
+and 1 or 0 for delete, sync and fsync. It is -1 for a malformed request.
+*/
+
+#define SFSD_MAGIC  0x53465344
+#define SFSD_MAX_IO (16 << 20)	//largest read or write in one request
+
+enum sfsd_op {
+	SFSD_CREATE = 1,
+	SFSD_DELETE,
+	SFSD_GETSIZE,
+	SFSD_READ,
+	SFSD_WRITE,
+	SFSD_TRUNCATE,
+	SFSD_FSYNC,
+	SFSD_SYNC,
+};
+
+struct sfsd_request {
+	uint32_t magic;
+	uint32_t op;
+	uint64_t tag;
+	int32_t  inumber;
+	uint32_t length;	//bytes to read, or bytes of data following a write
+	int64_t  offset;	//file offset, or the new size for truncate
+};
+
+struct sfsd_response {
+	uint32_t magic;
+	uint32_t op;
+	uint64_t tag;
+	int64_t  result;
+};
+
+#endif
@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include "fs.h"
+#include "trace.h"
+
+#define TRACE_NOPS (TRACE_SYNC+1)
+
+static const char *op_names[TRACE_NOPS] = {
+	0, "create", "write", "read", "truncate", "fsync", "delete", "sync"
+};
+
+struct trace_reader {
+	FILE *file;
+	int binary;
+	int line;
+};
+
+//Latencies of one kind of operation, kept whole so the percentiles are exact
+struct trace_stats {
+	int64_t *latency;
+	int count;
+	int size;
+	int errors;
+	int64_t bytes;
+};
+
+static int64_t now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static int parse_op( const char *name )
+{
+	int op;
+	for(op=1;op<TRACE_NOPS;op++) {
+		if(!strcmp(name,op_names[op])) return op;
+	}
+	return 0;
+}
+
+static int trace_next( struct trace_reader *r, struct trace_record *rec )
+{
+//Read the next operation; 0 at the end of the trace, -1 on a malformed entry
+	if(r->binary) {
+		size_t n = fread(rec,1,sizeof(*rec),r->file);
+		if(n==0) return 0;
+		if(n!=sizeof(*rec) || rec->op<1 || rec->op>=TRACE_NOPS) return -1;
+		return 1;
+	}
+
+	char line[1024], name[64];
+	long long time, offset, length;
+	int file = 0, n;
+
+	while(fgets(line,sizeof(line),r->file)) {
+		r->line++;
+		if(line[0]=='#' || line[0]=='\n') continue;
+
+		file = 0;
+		offset = length = 0;
+		n = sscanf(line,"%lld %63s %d %lld %lld",&time,name,&file,&offset,&length);
+		if(n<2) return -1;
+
+		memset(rec,0,sizeof(*rec));
+		rec->time = time;
+		rec->op = parse_op(name);
+		rec->file = file;
+		rec->offset = offset;
+		rec->length = length;
+
+		//check each operation has the fields it needs
+		switch(rec->op) {
+			case TRACE_SYNC:     return 1;
+			case TRACE_CREATE:
+			case TRACE_FSYNC:
+			case TRACE_DELETE:   return (n>=3) ? 1 : -1;
+			case TRACE_TRUNCATE: return (n>=4) ? 1 : -1;
+			case TRACE_WRITE:
+			case TRACE_READ:     return (n==5) ? 1 : -1;
+			default:             return -1;
+		}
+	}
+	return 0;
+}
+
+static int add_latency( struct trace_stats *s, int64_t ns )
+{
+	if(s->count==s->size) {
+		int size = s->size ? s->size*2 : 1024;
+		int64_t *latency = realloc(s->latency,size*sizeof(int64_t));
+		if(!latency) return 0;
+		s->latency = latency;
+		s->size = size;
+	}
+	s->latency[s->count++] = ns;
+	return 1;
+}
+
+static int compare_latency( const void *a, const void *b )
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x>y)-(x<y);
+}
+
+static void print_stats( const char *name, struct trace_stats *s )
+{
+	int i;
+	int64_t total = 0;
+
+	if(!s->count) return;
+	qsort(s->latency,s->count,sizeof(int64_t),compare_latency);
+	for(i=0;i<s->count;i++) total += s->latency[i];
+
+	printf("%-8s %8d ops %10.2f MB  mean %9.1f us  p50 %9.1f us  p99 %9.1f us  max %9.1f us",
+		name,s->count,s->bytes/1e6,
+		total/1e3/s->count,
+		s->latency[s->count/2]/1e3,
+		s->latency[(int)(s->count*0.99)]/1e3,
+		s->latency[s->count-1]/1e3);
+	if(s->errors) printf("  %d failed",s->errors);
+	printf("\n");
+}
+
+static int *map_file( int **files, int *nfiles, int file )
+{
+//The inode slot for a trace file number, growing the table as new numbers turn up
+	if(file<0) return 0;
+	if(file>=*nfiles) {
+		int n = *nfiles ? *nfiles : 64;
+		while(n<=file) n *= 2;
+		int *grown = realloc(*files,n*sizeof(int));
+		if(!grown) return 0;
+		memset(grown+*nfiles,0,(n-*nfiles)*sizeof(int));
+		*files = grown;
+		*nfiles = n;
+	}
+	return &(*files)[file];
+}
+
+int trace_replay( const char *filename, int timed, const char *latencyfile )
+{
+	struct trace_reader r = { 0, 0, 0 };
+	struct trace_record rec;
+	struct trace_stats stats[TRACE_NOPS];
+	char magic[8];
+	char *buffer = 0;
+	int *files = 0, nfiles = 0, bufsize = 0;
+	int i, result, nops = 0;
+	FILE *out = 0;
+
+	r.file = fopen(filename,"rb");
+	if(!r.file) {
+		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		return -1;
+	}
+	if(latencyfile) {
+		out = fopen(latencyfile,"w");
+		if(!out) {
+			printf("couldn't open %s: %s\n",latencyfile,strerror(errno));
+			fclose(r.file);
+			return -1;
+		}
+		fprintf(out,"op,name,file,offset,length,result,latency_ns\n");
+	}
+
+	//a binary trace announces itself, anything else is read as text
+	r.binary = fread(magic,1,sizeof(magic),r.file)==sizeof(magic) && !memcmp(magic,TRACE_MAGIC,sizeof(magic));
+	if(!r.binary) rewind(r.file);
+
+	memset(stats,0,sizeof(stats));
+	int64_t start = now(), t0, t1;
+
+	while((result = trace_next(&r,&rec))>0) {
+		//sync names no file, so it takes no slot
+		int *inode = (rec.op==TRACE_SYNC) ? 0 : map_file(&files,&nfiles,rec.file);
+		int64_t done = 0;
+		int length = (rec.length>INT_MAX) ? INT_MAX : (rec.length<0 ? 0 : rec.length);
+
+		if(rec.op!=TRACE_SYNC && !inode) {
+			printf("trace %s: bad file number %d\n",filename,rec.file);
+			result = -2;
+			break;
+		}
+
+		//reads and writes share one buffer, so its contents are whatever came last
+		if((rec.op==TRACE_WRITE || rec.op==TRACE_READ) && length>bufsize) {
+			char *grown = realloc(buffer,length);
+			if(!grown) {
+				printf("trace %s: out of memory for a %d byte operation\n",filename,length);
+				result = -2;
+				break;
+			}
+			for(i=bufsize;i<length;i++) grown[i] = i*31;
+			buffer = grown;
+			bufsize = length;
+		}
+
+		//a timed replay waits for the operation's place in the original run
+		if(timed) {
+			struct timespec due;
+			int64_t at = start + rec.time*1000;
+			due.tv_sec = at/1000000000;
+			due.tv_nsec = at%1000000000;
+			while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&due,0)==EINTR);
+		}
+
+		t0 = now();
+		switch(rec.op) {
+			case TRACE_CREATE:
+				*inode = fs_create();
+				done = *inode;
+				break;
+			case TRACE_WRITE:
+				done = fs_write(*inode,buffer,length,rec.offset);
+				if(done<length) done = -1;
+				break;
+			case TRACE_READ:
+				done = fs_read(*inode,buffer,length,rec.offset);
+				break;
+			case TRACE_TRUNCATE:
+				done = fs_truncate(*inode,rec.offset);
+				break;
+			case TRACE_FSYNC:
+				done = fs_fsync(*inode) ? 1 : -1;
+				break;
+			case TRACE_DELETE:
+				done = fs_delete(*inode) ? 1 : -1;
+				*inode = 0;
+				break;
+			case TRACE_SYNC:
+				done = fs_sync() ? 1 : -1;
+				break;
+		}
+		t1 = now();
+
+		struct trace_stats *s = &stats[rec.op];
+		if(done<0 || (rec.op==TRACE_CREATE && !done)) s->errors++;
+		else if(rec.op==TRACE_WRITE || rec.op==TRACE_READ) s->bytes += done;
+		add_latency(s,t1-t0);
+		if(out) fprintf(out,"%d,%s,%d,%lld,%lld,%lld,%lld\n",nops,op_names[rec.op],rec.file,(long long)rec.offset,(long long)rec.length,(long long)done,(long long)(t1-t0));
+		nops++;
+	}
+
+	double elapsed = (now()-start)/1e9;
+	if(result==-1) {
+		if(r.binary) printf("trace %s: bad record %d\n",filename,nops);
+		else printf("trace %s: bad entry on line %d\n",filename,r.line);
+	}
+
+	int64_t bytes = stats[TRACE_READ].bytes + stats[TRACE_WRITE].bytes;
+	printf("replayed %d operations in %.3f s: %.0f ops/s, %.2f MB/s\n",nops,elapsed,
+		elapsed>0 ? nops/elapsed : 0, elapsed>0 ? bytes/1e6/elapsed : 0);
+	for(i=1;i<TRACE_NOPS;i++) {
+		print_stats(op_names[i],&stats[i]);
+		free(stats[i].latency);
+	}
+
+	if(out) fclose(out);
+	fclose(r.file);
+	free(buffer);
+	free(files);
+	return (result<0) ? -1 : nops;
+}
@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+An operation trace is either text, one operation per line:
+
+	<usec> create   <file>
+	<usec> write    <file> <offset> <length>
+	<usec> read     <file> <offset> <length>
+	<usec> truncate <file> <size>
+	<usec> fsync    <file>
+	<usec> delete   <file>
+	<usec> sync
+
+or binary: the 8 bytes of TRACE_MAGIC followed by struct trace_record
+entries in host byte order. Files are numbered by the trace itself and
+mapped to whatever inodes create hands out during the replay. Times are
+microseconds since the start of the trace and are only honoured by a
+timed replay.
+*/
+
+#define TRACE_MAGIC "SFSTRACE"
+
+enum trace_op {
+	TRACE_CREATE = 1,
+	TRACE_WRITE,
+	TRACE_READ,
+	TRACE_TRUNCATE,
+	TRACE_FSYNC,
+	TRACE_DELETE,
+	TRACE_SYNC,
+};
+
+struct trace_record {
+	int64_t time;
+	int32_t op;
+	int32_t file;
+	int64_t offset;
+	int64_t length;
+};
+
+int trace_replay( const char *filename, int timed, const char *latencyfile );
+
+#endif
@@ -0,0 +1,119 @@
+#include "frame.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct frame_table * frame_table_create( int nframes )
+{
+	int i;
+	struct frame_table *ft;
+
+	ft = malloc(sizeof(struct frame_table));
+	if(!ft) return 0;
+
+	ft->frames = malloc(sizeof(struct frame)*nframes);
+	ft->free_stack = malloc(sizeof(int)*nframes);
+	if(!ft->frames || !ft->free_stack) {
+		frame_table_delete(ft);
+		return 0;
+	}
+
+	ft->nframes = nframes;
+	ft->nfree = nframes;
+
+	for(i=0;i<nframes;i++) {
+		memset(&ft->frames[i],0,sizeof(struct frame));
+		ft->frames[i].page = -1;
+
+		//stacked in reverse so frame 0 comes off first
+		ft->free_stack[i] = nframes-1-i;
+	}
+
+	return ft;
+}
+
+void frame_table_delete( struct frame_table *ft )
+{
+	free(ft->frames);
+	free(ft->free_stack);
+	free(ft);
+}
+
+int frame_alloc( struct frame_table *ft )
+{
+	if(ft->nfree==0) return -1;
+	return ft->free_stack[--ft->nfree];
+}
+
+void frame_load( struct frame_table *ft, int frame, int page, int dirty, unsigned int age )
+{
+	struct frame *f = &ft->frames[frame];
+	f->page = page;
+	f->age = age;
+	f->dirty = dirty;
+	f->referenced = 1;
+	f->cleaned = 0;
+}
+
+void frame_release( struct frame_table *ft, int frame )
+{
+	struct frame *f = &ft->frames[frame];
+	memset(f,0,sizeof(struct frame));
+	f->page = -1;
+	ft->free_stack[ft->nfree++] = frame;
+}
+
+int frame_table_check( struct frame_table *ft, struct page_table *pt )
+{
+	int i, frame, bits, ok = 1;
+	int npages = page_table_get_npages(pt);
+	char *seen = calloc(ft->nframes,1);
+
+	if(!seen) {
+		fprintf(stderr,"frame_table_check: out of memory\n");
+		return 0;
+	}
+
+	for(i=0;i<ft->nfree && ok;i++) {
+		int f = ft->free_stack[i];
+		if(f<0 || f>=ft->nframes || seen[f] || ft->frames[f].page!=-1) {
+			fprintf(stderr,"frame_table_check: bad free stack entry %d (frame %d)\n",i,f);
+			ok = 0;
+		} else {
+			seen[f] = 1;
+		}
+	}
+
+	for(i=0;i<ft->nframes && ok;i++) {
+		struct frame *f = &ft->frames[i];
+		if(seen[i]) continue;
+		if(f->page<0 || f->page>=npages) {
+			fprintf(stderr,"frame_table_check: frame %d is neither free nor holding a page\n",i);
+			ok = 0;
+			break;
+		}
+		//a resident page may have had its access revoked to sample its reference bit
+		page_table_get_entry(pt,f->page,&frame,&bits);
+		if(frame!=i) {
+			fprintf(stderr,"frame_table_check: frame %d holds page %d, which is not mapped to it\n",i,f->page);
+			ok = 0;
+		} else if(bits && !f->dirty != !(bits&PROT_WRITE)) {
+			fprintf(stderr,"frame_table_check: frame %d is %s but page %d is %s\n",i,
+				f->dirty ? "dirty" : "clean",f->page,(bits&PROT_WRITE) ? "writable" : "read-only");
+			ok = 0;
+		}
+	}
+
+	//a mapped page that no frame claims would be lost on eviction
+	for(i=0;i<npages && ok;i++) {
+		page_table_get_entry(pt,i,&frame,&bits);
+		if(bits && (frame<0 || frame>=ft->nframes || ft->frames[frame].page!=i)) {
+			fprintf(stderr,"frame_table_check: page %d is mapped to frame %d, which does not hold it\n",i,frame);
+			ok = 0;
+		}
+	}
+
+	free(seen);
+	return ok;
+}
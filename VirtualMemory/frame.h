@@ -0,0 +1,60 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "page_table.h"
+
+/*
+What the pager knows about one physical frame. The entries are kept in one
+array indexed by frame number, so a policy sweeping the frames walks memory
+in order.
+*/
+
+struct frame {
+	int page;			/* page held by the frame, or -1 if it is free */
+	unsigned int age;		/* caller's clock when the page was loaded */
+	unsigned char dirty;		/* the page is mapped writable and may differ from disk */
+	unsigned char referenced;	/* the page has been used since a policy last cleared this */
+	unsigned char cleaned;		/* the cleaner wrote the page back since it was loaded */
+};
+
+struct frame_table {
+	int nframes;
+	int nfree;
+	struct frame *frames;
+	int *free_stack;
+};
+
+/* Create a table of "nframes" frames, all free. Returns null on failure. */
+
+struct frame_table * frame_table_create( int nframes );
+
+/* Delete a frame table. */
+
+void frame_table_delete( struct frame_table *ft );
+
+/*
+Take a free frame off the free stack, or return -1 if every frame is in use.
+Frames are handed out lowest number first until the first one is released.
+*/
+
+int frame_alloc( struct frame_table *ft );
+
+/* Mark "frame" as holding "page", loaded at time "age" and clean or dirty. */
+
+void frame_load( struct frame_table *ft, int frame, int page, int dirty, unsigned int age );
+
+/* Return a frame to the free stack. */
+
+void frame_release( struct frame_table *ft, int frame );
+
+/*
+Check the frame table against the page table: every page held by a frame must
+be mapped to it, writable if and only if it is dirty unless its access has been
+revoked, no other page may be mapped, and
+every free frame must be on the free stack exactly once. Prints the first
+inconsistency found and returns 0, or returns 1 if the tables agree.
+*/
+
+int frame_table_check( struct frame_table *ft, struct page_table *pt );
+
+#endif
@@ -0,0 +1,170 @@
+#include "mrc.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MRC_HASH_RANGE (1 << 24)
+
+//Every page's last reference is marked in a Fenwick tree indexed by time, so the distinct
+//pages used since then are the marks after it. Times are renumbered once they run out.
+struct mrc_stack {
+	int *tree;
+	int *page_at;		//the page last referenced at each time, or -1
+	int *last;		//the time of each page's last reference, or -1
+	int size;
+	int now;
+};
+
+static void tree_add(struct mrc_stack *s, int t, int delta) {
+	for (t++; t <= s->size; t += t & -t) s->tree[t] += delta;
+}
+
+static int tree_sum(struct mrc_stack *s, int t) {
+	//Marks at times before t
+	int sum = 0;
+	for (; t > 0; t -= t & -t) sum += s->tree[t];
+	return sum;
+}
+
+static void compact(struct mrc_stack *s) {
+	int t, next = 0;
+
+	//Pages keep their order but move to the earliest times, and the tree is rebuilt in place
+	for (t = 0; t < s->size; t++) {
+		int page = s->page_at[t];
+		s->page_at[t] = -1;
+		if (page < 0) continue;
+		s->page_at[next] = page;
+		s->last[page] = next;
+		next++;
+	}
+
+	memset(s->tree, 0, (s->size + 1) * sizeof(int));
+	for (t = 1; t <= s->size; t++) {
+		if (t <= next) s->tree[t]++;
+		int parent = t + (t & -t);
+		if (parent <= s->size) s->tree[parent] += s->tree[t];
+	}
+	s->now = next;
+}
+
+static uint32_t hash_page(uint32_t page) {
+	page ^= page >> 16;
+	page *= 0x7feb352d;
+	page ^= page >> 15;
+	page *= 0x846ca68b;
+	page ^= page >> 16;
+	return page;
+}
+
+int mrc_compute(const uint32_t *refs, int64_t count, int npages, double rate, double *misses) {
+	struct mrc_stack s;
+	int64_t i, cold = 0, sampled = 0, *hist, *seen;
+	int page, d, npicked = 0, ok = 0;
+
+	if (rate <= 0 || rate > 1) rate = 1;
+	uint32_t threshold = rate * MRC_HASH_RANGE;
+
+	//A page stays marked at most once, so twice the pages in times renumbers at most every npages references
+	s.size = 2 * npages + 2;
+	s.now = 0;
+	s.tree = calloc(s.size + 1, sizeof(int));
+	s.page_at = malloc(s.size * sizeof(int));
+	s.last = malloc(npages * sizeof(int));
+	hist = calloc(npages + 1, sizeof(int64_t));
+	seen = malloc(npages * sizeof(int64_t));
+	if (!s.tree || !s.page_at || !s.last || !hist || !seen) goto done;
+
+	for (i = 0; i < s.size; i++) s.page_at[i] = -1;
+	for (page = 0; page < npages; page++) {
+		s.last[page] = -1;
+		if (rate == 1 || (hash_page(page) & (MRC_HASH_RANGE - 1)) < threshold) npicked++;
+	}
+
+	//Distances are scaled by the fraction of the other pages actually sampled rather than by the
+	//rate, which the hash only meets on average. The page referenced is always one of those sampled.
+	double spread = (npicked > 1) ? (double)(npages - 1) / (npicked - 1) : 0;
+
+	for (i = 0; i < count; i++) {
+		page = TRACE_PAGE(refs[i]);
+		if (rate < 1 && (hash_page(page) & (MRC_HASH_RANGE - 1)) >= threshold) continue;
+
+		sampled++;
+
+		if (s.now == s.size) compact(&s);
+
+		int t = s.last[page];
+		if (t < 0) {
+			cold++;
+		} else {
+			//The distance counts the page itself once and each other sampled page stands for spread pages.
+			//There was at least one other page if another came in between, and at most the references between.
+			d = tree_sum(&s, s.now) - tree_sum(&s, t);
+			int64_t others = (int64_t)((d - 1) * spread + 0.5), between = i - seen[page] - 1;
+			if (others == 0 && between > 0) others = 1;
+			if (others > between) others = between;
+			hist[others < npages ? others + 1 : npages]++;
+			tree_add(&s, t, -1);
+			s.page_at[t] = -1;
+		}
+
+		tree_add(&s, s.now, 1);
+		s.page_at[s.now] = page;
+		s.last[page] = s.now;
+		seen[page] = i;
+		s.now++;
+	}
+
+	//Each page misses cold once, so cold misses scale with the pages sampled, and the other
+	//references with those actually sampled, making up the rest of the trace
+	double cold_misses = npicked ? (double)cold * npages / npicked : 0;
+	if (cold_misses > count) cold_misses = count;
+	double scale = (sampled > cold) ? (count - cold_misses) / (sampled - cold) : 0;
+	misses[0] = 0;
+	for (d = 1; d <= npages; d++) misses[d] = hist[d] * scale;
+
+	//misses[c] now holds the references at distance c; summing from the top gives those beyond c
+	double beyond = cold_misses;
+	for (d = npages; d >= 0; d--) {
+		double at = misses[d];
+		misses[d] = beyond;
+		beyond += at;
+	}
+	ok = 1;
+
+done:
+	free(s.tree);
+	free(s.page_at);
+	free(s.last);
+	free(hist);
+	free(seen);
+	return ok;
+}
+
+int mrc_check(const uint32_t *refs, int64_t count, int npages, double rate, const double *misses) {
+	double *exact = malloc((npages + 1) * sizeof(double));
+	double worst = 0;
+	int c, at = 1;
+
+	if (!exact || !mrc_compute(refs, count, npages, 1, exact)) {
+		fprintf(stderr, "mrc: out of memory\n");
+		free(exact);
+		return 0;
+	}
+
+	for (c = 1; c <= npages; c++) {
+		double off = fabs(misses[c] - exact[c]) / (count ? count : 1);
+		if (off > worst) {
+			worst = off;
+			at = c;
+		}
+	}
+	free(exact);
+
+	double allowed = (rate < 1 && count) ? 2 / sqrt(rate * count) : 0;
+	fprintf(stderr, "sampled miss ratio is %.6f from exact at %d frames, %.6f allowed\n", worst, at, allowed);
+	return worst <= allowed + 1e-9;
+}
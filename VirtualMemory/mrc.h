@@ -0,0 +1,33 @@
+#ifndef MRC_H
+#define MRC_H
+
+#include <stdint.h>
+
+/*
+Miss ratio curves for LRU replacement. A page's stack distance at a reference
+is the number of distinct pages used since its last reference, counting itself,
+and LRU with c frames misses exactly when that distance is above c. So one pass
+over a trace gives the misses for every number of frames at once.
+*/
+
+/*
+Fill misses[c], for c from 0 to "npages", with the misses LRU would take
+replaying the "count" references in "refs" with c frames. A "rate" below 1
+follows only that fraction of the pages, chosen by a hash of the page number,
+and scales the result up, trading accuracy for time and memory on large traces.
+Returns 1 on success, or 0 if there was not enough memory.
+*/
+
+int mrc_compute( const uint32_t *refs, int64_t count, int npages, double rate, double *misses );
+
+/*
+Check "misses", computed by mrc_compute at "rate", against the exact curve for
+the same references. Sampling "rate" of "count" references leaves a miss ratio
+within about two standard errors, 2/sqrt(rate*count), of the exact one. Prints
+the frames where the curves are furthest apart to stderr and returns 1 if they are within
+that, or 0 if they are not or there was not enough memory.
+*/
+
+int mrc_check( const uint32_t *refs, int64_t count, int npages, double rate, const double *misses );
+
+#endif
@@ -0,0 +1,132 @@
+#include "opt.h"
+#include "trace.h"
+
+#include <stdlib.h>
+
+#define NEVER UINT32_MAX
+
+//Resident pages sit in a max-heap keyed by their next use, with ties between pages that are
+//never used again broken toward clean pages, whose eviction costs no write
+struct opt_heap {
+	uint64_t *key;		//indexed by page
+	int *heap;		//pages, furthest next use first
+	int *pos;		//position of each page in heap, or -1
+	int size;
+};
+
+static void heap_swap(struct opt_heap *h, int a, int b) {
+	int pa = h->heap[a], pb = h->heap[b];
+	h->heap[a] = pb;
+	h->heap[b] = pa;
+	h->pos[pb] = a;
+	h->pos[pa] = b;
+}
+
+static void heap_up(struct opt_heap *h, int i) {
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (h->key[h->heap[parent]] >= h->key[h->heap[i]]) break;
+		heap_swap(h, i, parent);
+		i = parent;
+	}
+}
+
+static void heap_down(struct opt_heap *h, int i) {
+	while (1) {
+		int left = 2*i + 1, right = left + 1, largest = i;
+		if (left < h->size && h->key[h->heap[left]] > h->key[h->heap[largest]]) largest = left;
+		if (right < h->size && h->key[h->heap[right]] > h->key[h->heap[largest]]) largest = right;
+		if (largest == i) break;
+		heap_swap(h, i, largest);
+		i = largest;
+	}
+}
+
+static void heap_set(struct opt_heap *h, int page, uint64_t key) {
+	uint64_t old = h->key[page];
+	h->key[page] = key;
+	if (key > old) heap_up(h, h->pos[page]);
+	else heap_down(h, h->pos[page]);
+}
+
+static void heap_push(struct opt_heap *h, int page, uint64_t key) {
+	h->key[page] = key;
+	h->heap[h->size] = page;
+	h->pos[page] = h->size;
+	h->size++;
+	heap_up(h, h->size - 1);
+}
+
+static int heap_pop(struct opt_heap *h) {
+	int page = h->heap[0];
+	h->size--;
+	if (h->size > 0) {
+		h->heap[0] = h->heap[h->size];
+		h->pos[h->heap[0]] = 0;
+		heap_down(h, 0);
+	}
+	h->pos[page] = -1;
+	return page;
+}
+
+int opt_simulate(const uint32_t *refs, int64_t count, int npages, int nframes, struct opt_result *result) {
+	struct opt_heap h;
+	int64_t i;
+	int page, ok = 0;
+
+	result->page_faults = result->disk_reads = result->disk_writes = 0;
+	if (count >= NEVER) return 0;
+
+	uint32_t *next = malloc(count ? count * sizeof(uint32_t) : 1);
+	uint32_t *seen = malloc(npages * sizeof(uint32_t));
+	unsigned char *state = calloc(npages, 1);	//bit 0 writable, bit 1 dirty
+	h.key = malloc(npages * sizeof(uint64_t));
+	h.heap = malloc(npages * sizeof(int));
+	h.pos = malloc(npages * sizeof(int));
+	h.size = 0;
+	if (!next || !seen || !state || !h.key || !h.heap || !h.pos) goto done;
+
+	//One pass backwards gives every reference the time of the next one to the same page
+	for (page = 0; page < npages; page++) {
+		seen[page] = NEVER;
+		h.pos[page] = -1;
+	}
+	for (i = count - 1; i >= 0; i--) {
+		page = TRACE_PAGE(refs[i]);
+		next[i] = seen[page];
+		seen[page] = i;
+	}
+
+	for (i = 0; i < count; i++) {
+		int write = TRACE_WRITE(refs[i]);
+		page = TRACE_PAGE(refs[i]);
+
+		if (h.pos[page] < 0) {
+			result->page_faults++;
+			result->disk_reads++;
+			if (h.size == nframes) {
+				int victim = heap_pop(&h);
+				if (state[victim] & 2) result->disk_writes++;
+			}
+			state[page] = write ? 3 : 0;
+			heap_push(&h, page, ((uint64_t)next[i] << 1) | !(state[page] & 2));
+		} else {
+			//A write to a page loaded by a read takes a second fault, as in the pager
+			if (write && !(state[page] & 1)) {
+				result->page_faults++;
+				state[page] = 3;
+			}
+			heap_set(&h, page, ((uint64_t)next[i] << 1) | !(state[page] & 2));
+		}
+	}
+	ok = 1;
+
+done:
+	free(next);
+	free(seen);
+	free(state);
+	free(h.key);
+	free(h.heap);
+	free(h.pos);
+	return ok;
+}
@@ -0,0 +1,27 @@
+#ifndef OPT_H
+#define OPT_H
+
+#include <stdint.h>
+
+/*
+Belady's optimal replacement (MIN), which no real pager can run because it
+needs the future: on a miss with every frame in use, it evicts the page whose
+next use is furthest away. Given a whole trace it is the lower bound on the
+disk reads any policy needs for that trace and number of frames.
+*/
+
+struct opt_result {
+	int page_faults;
+	int disk_reads;
+	int disk_writes;
+};
+
+/*
+Run the "count" references in "refs" over "npages" pages with "nframes"
+frames, counting faults, reads and writes the way the pager does.
+Returns 1 on success, or 0 if there was not enough memory.
+*/
+
+int opt_simulate( const uint32_t *refs, int64_t count, int npages, int nframes, struct opt_result *result );
+
+#endif
@@ -0,0 +1,42 @@
+#include "page_list.h"
+
+void list_init(struct page_list *l) {
+	l->head = l->tail = -1;
+	l->size = 0;
+}
+
+void list_push(struct list_node *nodes, struct page_list *l, int page) {
+	struct list_node *n = &nodes[page];
+	n->list = l;
+	n->prev = -1;
+	n->next = l->head;
+	if (l->head >= 0) nodes[l->head].prev = page;
+	else l->tail = page;
+	l->head = page;
+	l->size++;
+}
+
+void list_remove(struct list_node *nodes, int page) {
+	struct list_node *n = &nodes[page];
+	struct page_list *l = n->list;
+	if (n->prev >= 0) nodes[n->prev].next = n->next;
+	else l->head = n->next;
+	if (n->next >= 0) nodes[n->next].prev = n->prev;
+	else l->tail = n->prev;
+	l->size--;
+	n->list = 0;
+}
+
+int list_pop(struct list_node *nodes, struct page_list *l) {
+	int page = l->tail;
+	list_remove(nodes, page);
+	return page;
+}
+
+int list_oldest(struct list_node *nodes, const struct page_list *l, int *frames, int count) {
+	int page, n = 0;
+	for (page = l->tail; page >= 0 && n < count; page = nodes[page].prev) {
+		frames[n++] = nodes[page].frame;
+	}
+	return n;
+}
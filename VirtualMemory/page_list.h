@@ -0,0 +1,44 @@
+#ifndef PAGE_LIST_H
+#define PAGE_LIST_H
+
+/*
+LRU lists of page numbers for the policies that need them. The links live in
+an array of nodes with one node per page, so a page is on at most one list and
+every operation is O(1).
+*/
+
+struct page_list {
+	int head, tail;		/* most and least recently used, or -1 */
+	int size;
+};
+
+struct list_node {
+	int prev, next;
+	int frame;		/* frame holding the page, for the policy's use */
+	struct page_list *list;	/* list holding the page, or null */
+};
+
+/* Make "l" an empty list. */
+
+void list_init( struct page_list *l );
+
+/* Add "page" to "l" as its most recently used page. */
+
+void list_push( struct list_node *nodes, struct page_list *l, int page );
+
+/* Take "page" off whatever list it is on. */
+
+void list_remove( struct list_node *nodes, int page );
+
+/* Take the least recently used page off "l" and return it. "l" must not be empty. */
+
+int list_pop( struct list_node *nodes, struct page_list *l );
+
+/*
+Write the frames of up to "count" of the least recently used pages of "l" to
+"frames", least recent first, and return how many there were.
+*/
+
+int list_oldest( struct list_node *nodes, const struct page_list *l, int *frames, int count );
+
+#endif
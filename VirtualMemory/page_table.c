@@ -14,6 +14,7 @@ Make all of your changes to main.c instead.
 #include <fcntl.h>
 #include <stdlib.h>
 #include <ucontext.h>
+#include <signal.h>
 
 #include "page_table.h"
 
@@ -30,6 +31,16 @@ struct page_table {
 
 struct page_table *the_page_table = 0;
 
+static int fault_access( void *context )
+{
+#ifdef REG_ERR
+	/* bit 1 of the x86 page fault error code is set for a write */
+	ucontext_t *uc = context;
+	if(uc->uc_mcontext.gregs[REG_ERR] & 2) return PROT_WRITE;
+#endif
+	return PROT_READ;
+}
+
 static void internal_fault_handler( int signum, siginfo_t *info, void *context )
 {
 
@@ -45,7 +56,7 @@ static void internal_fault_handler( int signum, siginfo_t *info, void *context )
 		int page = (addr-pt->virtmem) / PAGE_SIZE;
 
 		if(page>=0 && page<pt->npages) {
-			pt->handler(pt,page);
+			pt->handler(pt,page,fault_access(context));
 			return;
 		}
 	}
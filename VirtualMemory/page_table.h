@@ -9,11 +9,13 @@
 
 struct page_table;
 
-typedef void (*page_fault_handler_t) ( struct page_table *pt, int page );
+typedef void (*page_fault_handler_t) ( struct page_table *pt, int page, int access );
 
 /* Create a new page table, along with a corresponding virtual memory
 that is "npages" big and a physical memory that is "nframes" bit
- When a page fault occurs, the routine pointed to by "handler" will be called. */
+ When a page fault occurs, the routine pointed to by "handler" will be called.
+ "access" is PROT_WRITE if the faulting access was a write and PROT_READ otherwise,
+ including on machines where the kind of access cannot be told. */
 
 struct page_table * page_table_create( int npages, int nframes, page_fault_handler_t handler );
 
@@ -0,0 +1,151 @@
+/*
+A page table for the simulator. It keeps the same entries as page_table.c,
+but nothing is mapped: accesses are reported with page_table_sim_access.
+*/
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "page_table_sim.h"
+
+struct page_table {
+	char *physmem;
+	int npages;
+	int nframes;
+	int *page_mapping;
+	int *page_bits;
+	page_fault_handler_t handler;
+};
+
+struct page_table * page_table_create( int npages, int nframes, page_fault_handler_t handler )
+{
+	int i;
+	struct page_table *pt;
+
+	pt = malloc(sizeof(struct page_table));
+	if(!pt) return 0;
+
+	/* the pager only passes frame addresses to the simulated disk, so this is never touched */
+	pt->physmem = mmap(0,(size_t)nframes*PAGE_SIZE,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+	if(pt->physmem==MAP_FAILED) {
+		free(pt);
+		return 0;
+	}
+
+	pt->npages = npages;
+	pt->nframes = nframes;
+	pt->page_bits = malloc(sizeof(int)*npages);
+	pt->page_mapping = malloc(sizeof(int)*npages);
+	pt->handler = handler;
+
+	if(!pt->page_bits || !pt->page_mapping) {
+		page_table_delete(pt);
+		return 0;
+	}
+
+	for(i=0;i<npages;i++) {
+		pt->page_bits[i] = 0;
+		pt->page_mapping[i] = 0;
+	}
+
+	return pt;
+}
+
+void page_table_delete( struct page_table *pt )
+{
+	munmap(pt->physmem,(size_t)pt->nframes*PAGE_SIZE);
+	free(pt->page_bits);
+	free(pt->page_mapping);
+	free(pt);
+}
+
+void page_table_sim_access( struct page_table *pt, int page, int access )
+{
+	int need = (access==PROT_WRITE) ? PROT_WRITE : PROT_READ;
+
+	if( page<0 || page>=pt->npages ) {
+		fprintf(stderr,"page_table_sim_access: illegal page #%d\n",page);
+		abort();
+	}
+
+	/* like the hardware, retry the access until the entry allows it */
+	while(!(pt->page_bits[page] & need)) {
+		pt->handler(pt,page,access);
+	}
+}
+
+void page_table_set_entry( struct page_table *pt, int page, int frame, int bits )
+{
+	if( page<0 || page>=pt->npages ) {
+		fprintf(stderr,"page_table_set_entry: illegal page #%d\n",page);
+		abort();
+	}
+
+	if( frame<0 || frame>=pt->nframes ) {
+		fprintf(stderr,"page_table_set_entry: illegal frame #%d\n",frame);
+		abort();
+	}
+
+	pt->page_mapping[page] = frame;
+	pt->page_bits[page] = bits;
+}
+
+void page_table_get_entry( struct page_table *pt, int page, int *frame, int *bits )
+{
+	if( page<0 || page>=pt->npages ) {
+		fprintf(stderr,"page_table_get_entry: illegal page #%d\n",page);
+		abort();
+	}
+
+	*frame = pt->page_mapping[page];
+	*bits = pt->page_bits[page];
+}
+
+void page_table_print_entry( struct page_table *pt, int page )
+{
+	if( page<0 || page>=pt->npages ) {
+		fprintf(stderr,"page_table_print_entry: illegal page #%d\n",page);
+		abort();
+	}
+
+	int b = pt->page_bits[page];
+
+	printf("page %06d: frame %06d bits %c%c%c\n",
+		page,
+		pt->page_mapping[page],
+		b&PROT_READ  ? 'r' : '-',
+		b&PROT_WRITE ? 'w' : '-',
+		b&PROT_EXEC  ? 'x' : '-'
+	);
+
+}
+
+void page_table_print( struct page_table *pt )
+{
+	int i;
+	for(i=0;i<pt->npages;i++) {
+		page_table_print_entry(pt,i);
+	}
+}
+
+int page_table_get_nframes( struct page_table *pt )
+{
+	return pt->nframes;
+}
+
+int page_table_get_npages( struct page_table *pt )
+{
+	return pt->npages;
+}
+
+char * page_table_get_virtmem( struct page_table *pt )
+{
+	return 0;
+}
+
+char * page_table_get_physmem( struct page_table *pt )
+{
+	return pt->physmem;
+}
@@ -0,0 +1,16 @@
+#ifndef PAGE_TABLE_SIM_H
+#define PAGE_TABLE_SIM_H
+
+#include "page_table.h"
+
+/*
+page_table_sim.c implements page_table.h without any real memory: there are
+no pages to touch, so the simulator reports each access here instead, and the
+fault handler is called whenever the entry for the page would not allow it.
+*/
+
+/* Access "page" for reading (PROT_READ) or writing (PROT_WRITE). */
+
+void page_table_sim_access( struct page_table *pt, int page, int access );
+
+#endif
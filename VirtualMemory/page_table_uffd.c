@@ -0,0 +1,281 @@
+/*
+A page table built on userfaultfd instead of SIGSEGV and remap_file_pages.
+
+It implements the same interface as page_table.c, so main.c links against
+either one. Faults are read from a userfaultfd by a thread of their own,
+which calls the page fault handler outside of signal context while the
+faulting thread stays blocked in the kernel.
+
+Virtual memory is anonymous, so a page cannot alias its frame the way the
+shared file mapping in page_table.c does. Mapping a page copies the frame
+into it with UFFDIO_COPY, and a writable page is copied back into its frame
+when it is unmapped or write protected. Physical memory therefore only holds
+a writable page's current contents once its entry has been set to read-only
+or to no access, so a page must be unmapped before its frame is written out.
+*/
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/userfaultfd.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "page_table.h"
+
+struct page_table {
+	int uffd;
+	char *virtmem;
+	int npages;
+	char *physmem;
+	int nframes;
+	int *page_mapping;
+	int *page_bits;
+	page_fault_handler_t handler;
+	pthread_t thread;
+};
+
+static void uffd_fail( const char *what, int page )
+{
+	fprintf(stderr,"page_table: %s failed for page #%d: %s\n",what,page,strerror(errno));
+	abort();
+}
+
+static void * fault_thread( void *arg )
+{
+	struct page_table *pt = arg;
+	struct uffd_msg msg;
+
+	while(1) {
+		ssize_t n = read(pt->uffd,&msg,sizeof(msg));
+		if(n<0 && (errno==EINTR || errno==EAGAIN)) continue;
+		if(n!=sizeof(msg)) {
+			fprintf(stderr,"page_table: couldn't read fault: %s\n",strerror(errno));
+			abort();
+		}
+		if(msg.event!=UFFD_EVENT_PAGEFAULT) continue;
+
+		char *addr = (char*)(uintptr_t)msg.arg.pagefault.address;
+		int page = (addr-pt->virtmem) / PAGE_SIZE;
+
+		//a write protect fault can only come from a write
+		int access = (msg.arg.pagefault.flags & (UFFD_PAGEFAULT_FLAG_WRITE|UFFD_PAGEFAULT_FLAG_WP)) ? PROT_WRITE : PROT_READ;
+		pt->handler(pt,page,access);
+
+		//the faulting thread retries whether or not the handler mapped the page
+		struct uffdio_range range;
+		range.start = (uintptr_t)(pt->virtmem+(size_t)page*PAGE_SIZE);
+		range.len = PAGE_SIZE;
+		ioctl(pt->uffd,UFFDIO_WAKE,&range);
+	}
+	return 0;
+}
+
+struct page_table * page_table_create( int npages, int nframes, page_fault_handler_t handler )
+{
+	int i;
+	struct page_table *pt;
+	struct uffdio_api api;
+	struct uffdio_register reg;
+
+	pt = malloc(sizeof(struct page_table));
+	if(!pt) return 0;
+
+	//unprivileged users may only catch faults taken in user mode
+	pt->uffd = syscall(SYS_userfaultfd,O_CLOEXEC);
+	if(pt->uffd<0) pt->uffd = syscall(SYS_userfaultfd,O_CLOEXEC|UFFD_USER_MODE_ONLY);
+	if(pt->uffd<0) {
+		free(pt);
+		return 0;
+	}
+
+	memset(&api,0,sizeof(api));
+	api.api = UFFD_API;
+	api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+	if(ioctl(pt->uffd,UFFDIO_API,&api)<0) {
+		close(pt->uffd);
+		free(pt);
+		return 0;
+	}
+
+	pt->physmem = mmap(0,(size_t)nframes*PAGE_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+	pt->nframes = nframes;
+
+	pt->virtmem = mmap(0,(size_t)npages*PAGE_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+	pt->npages = npages;
+
+	if(pt->physmem==MAP_FAILED || pt->virtmem==MAP_FAILED) {
+		if(pt->physmem!=MAP_FAILED) munmap(pt->physmem,(size_t)nframes*PAGE_SIZE);
+		if(pt->virtmem!=MAP_FAILED) munmap(pt->virtmem,(size_t)npages*PAGE_SIZE);
+		close(pt->uffd);
+		free(pt);
+		return 0;
+	}
+
+	//a missing page is unmapped, and a write protected one is read-only
+	memset(&reg,0,sizeof(reg));
+	reg.range.start = (uintptr_t)pt->virtmem;
+	reg.range.len = (size_t)npages*PAGE_SIZE;
+	reg.mode = UFFDIO_REGISTER_MODE_MISSING|UFFDIO_REGISTER_MODE_WP;
+	if(ioctl(pt->uffd,UFFDIO_REGISTER,&reg)<0) {
+		int saved = errno;
+		munmap(pt->physmem,(size_t)nframes*PAGE_SIZE);
+		munmap(pt->virtmem,(size_t)npages*PAGE_SIZE);
+		close(pt->uffd);
+		free(pt);
+		errno = saved;
+		return 0;
+	}
+
+	pt->page_bits = malloc(sizeof(int)*npages);
+	pt->page_mapping = malloc(sizeof(int)*npages);
+
+	pt->handler = handler;
+
+	for(i=0;i<pt->npages;i++) {
+		pt->page_bits[i] = 0;
+		pt->page_mapping[i] = 0;
+	}
+
+	if(pthread_create(&pt->thread,0,fault_thread,pt)!=0) {
+		pt->thread = 0;
+		page_table_delete(pt);
+		return 0;
+	}
+
+	return pt;
+}
+
+void page_table_delete( struct page_table *pt )
+{
+	if(pt->thread) {
+		pthread_cancel(pt->thread);
+		pthread_join(pt->thread,0);
+	}
+	munmap(pt->virtmem,(size_t)pt->npages*PAGE_SIZE);
+	munmap(pt->physmem,(size_t)pt->nframes*PAGE_SIZE);
+	free(pt->page_bits);
+	free(pt->page_mapping);
+	close(pt->uffd);
+	free(pt);
+}
+
+static void write_protect( struct page_table *pt, int page, int protect )
+{
+	struct uffdio_writeprotect wp;
+
+	wp.range.start = (uintptr_t)(pt->virtmem+(size_t)page*PAGE_SIZE);
+	wp.range.len = PAGE_SIZE;
+	//the kernel only takes DONTWAKE when removing protection
+	wp.mode = protect ? UFFDIO_WRITEPROTECT_MODE_WP : UFFDIO_WRITEPROTECT_MODE_DONTWAKE;
+	if(ioctl(pt->uffd,UFFDIO_WRITEPROTECT,&wp)<0) uffd_fail("UFFDIO_WRITEPROTECT",page);
+}
+
+void page_table_set_entry( struct page_table *pt, int page, int frame, int bits )
+{
+	if( page<0 || page>=pt->npages ) {
+		fprintf(stderr,"page_table_set_entry: illegal page #%d\n",page);
+		abort();
+	}
+
+	if( frame<0 || frame>=pt->nframes ) {
+		fprintf(stderr,"page_table_set_entry: illegal frame #%d\n",frame);
+		abort();
+	}
+
+	char *addr = pt->virtmem+(size_t)page*PAGE_SIZE;
+	int oldframe = pt->page_mapping[page];
+	int oldbits = pt->page_bits[page];
+
+	//a page leaving its frame takes its writes back there, then goes missing
+	if(oldbits && (!bits || frame!=oldframe)) {
+		if(oldbits&PROT_WRITE) memcpy(pt->physmem+(size_t)oldframe*PAGE_SIZE,addr,PAGE_SIZE);
+		if(madvise(addr,PAGE_SIZE,MADV_DONTNEED)<0) uffd_fail("MADV_DONTNEED",page);
+		oldbits = 0;
+	}
+
+	if(bits && !oldbits) {
+		struct uffdio_copy copy;
+		copy.dst = (uintptr_t)addr;
+		copy.src = (uintptr_t)(pt->physmem+(size_t)frame*PAGE_SIZE);
+		copy.len = PAGE_SIZE;
+		copy.mode = UFFDIO_COPY_MODE_DONTWAKE | ((bits&PROT_WRITE) ? 0 : UFFDIO_COPY_MODE_WP);
+		copy.copy = 0;
+		if(ioctl(pt->uffd,UFFDIO_COPY,&copy)<0) uffd_fail("UFFDIO_COPY",page);
+	} else if(bits && (oldbits&PROT_WRITE) && !(bits&PROT_WRITE)) {
+		write_protect(pt,page,1);
+		memcpy(pt->physmem+(size_t)frame*PAGE_SIZE,addr,PAGE_SIZE);
+	} else if(bits && !(oldbits&PROT_WRITE) && (bits&PROT_WRITE)) {
+		write_protect(pt,page,0);
+	}
+
+	pt->page_mapping[page] = frame;
+	pt->page_bits[page] = bits;
+}
+
+void page_table_get_entry( struct page_table *pt, int page, int *frame, int *bits )
+{
+	if( page<0 || page>=pt->npages ) {
+		fprintf(stderr,"page_table_get_entry: illegal page #%d\n",page);
+		abort();
+	}
+
+	*frame = pt->page_mapping[page];
+	*bits = pt->page_bits[page];
+}
+
+void page_table_print_entry( struct page_table *pt, int page )
+{
+	if( page<0 || page>=pt->npages ) {
+		fprintf(stderr,"page_table_print_entry: illegal page #%d\n",page);
+		abort();
+	}
+
+	int b = pt->page_bits[page];
+
+	printf("page %06d: frame %06d bits %c%c%c\n",
+		page,
+		pt->page_mapping[page],
+		b&PROT_READ  ? 'r' : '-',
+		b&PROT_WRITE ? 'w' : '-',
+		b&PROT_EXEC  ? 'x' : '-'
+	);
+
+}
+
+void page_table_print( struct page_table *pt )
+{
+	int i;
+	for(i=0;i<pt->npages;i++) {
+		page_table_print_entry(pt,i);
+	}
+}
+
+int page_table_get_nframes( struct page_table *pt )
+{
+	return pt->nframes;
+}
+
+int page_table_get_npages( struct page_table *pt )
+{
+	return pt->npages;
+}
+
+char * page_table_get_virtmem( struct page_table *pt )
+{
+	return pt->virtmem;
+}
+
+char * page_table_get_physmem( struct page_table *pt )
+{
+	return pt->physmem;
+}
@@ -0,0 +1,250 @@
+#include "pager.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct pager *the_pager = 0;
+
+static void revoke_samples(struct pager *pg) {
+	while (pg->nsamples > 0) {
+		pager_clear_reference(pg, pg->sample_queue[--pg->nsamples]);
+	}
+}
+
+static void wait_for_writeback(struct pager *pg, int page) {
+	//The cleaner writes without the lock, so a read or write of the same block has to wait for it
+	while (pg->cleaning_page == page) {
+		pthread_cond_wait(&pg->cleaned, &pg->lock);
+	}
+}
+
+static void evict_page(struct pager *pg, int frame) {
+	struct frame *f = &pg->frames->frames[frame];
+	int victim = f->page;
+
+	// Unmap first: a page table may only bring the frame up to date when the page leaves it
+	page_table_set_entry(pg->pt, victim, frame, 0);
+
+	// An older copy still being cleaned must not land on disk after this one
+	if (f->dirty) wait_for_writeback(pg, victim);
+
+	if (f->dirty) { // Page to be replaced has write permissions
+		disk_write(pg->disk, victim, &pg->physmem[frame*PAGE_SIZE]);
+		pg->disk_writes++;
+	}
+
+	if (pg->policy->on_evict) pg->policy->on_evict(pg, victim, frame);
+}
+
+static void handle_fault(struct pager *pg, struct page_table *pt, int page, int access) {
+	int frame, bits;
+
+	page_table_get_entry(pt, page, &frame, &bits);
+
+	if (bits == 0 && frame >= 0 && frame < pg->nframes && pg->frames->frames[frame].page == page) {
+		//Still resident, but its access was revoked to sample the reference bit
+		struct frame *f = &pg->frames->frames[frame];
+		pg->ref_faults++;
+		f->referenced = 1;
+		if (access == PROT_WRITE) f->dirty = 1;
+		page_table_set_entry(pt, page, frame, f->dirty ? (PROT_READ|PROT_WRITE) : PROT_READ);
+		if (pg->policy->on_access) pg->policy->on_access(pg, page, frame);
+		return;
+	}
+
+	pg->page_faults++;
+
+	if (bits == 0) { //Has neither read or write. Must employ policy
+
+		//A write maps the page writable, and so dirty, straight away instead of faulting again
+		int newbits = (access == PROT_WRITE) ? (PROT_READ|PROT_WRITE) : PROT_READ;
+
+		wait_for_writeback(pg, page);
+		revoke_samples(pg);
+
+		frame = pg->policy->on_fault(pg, page, frame_alloc(pg->frames));
+		if (pg->frames->frames[frame].page >= 0) evict_page(pg, frame);
+
+		disk_read(pg->disk, page, &pg->physmem[frame*PAGE_SIZE]);
+		pg->disk_reads++;
+		page_table_set_entry(pt, page, frame, newbits);
+		frame_load(pg->frames, frame, page, newbits & PROT_WRITE, pg->page_faults);
+
+		if (pg->policy->on_load) pg->policy->on_load(pg, page, frame);
+
+	} else { //Has read permission. Add write permission
+
+		page_table_set_entry(pt, page, frame, (PROT_READ|PROT_WRITE));
+		pg->frames->frames[frame].dirty = 1;
+	}
+}
+
+static void page_fault_handler(struct page_table *pt, int page, int access) {
+	struct pager *pg = the_pager;
+
+	pthread_mutex_lock(&pg->lock);
+	handle_fault(pg, pt, page, access);
+	if (pg->cleaner_running) pthread_cond_signal(&pg->wake_cleaner);
+	pthread_mutex_unlock(&pg->lock);
+}
+
+static int next_to_clean(struct pager *pg) {
+	//Only the frames the policy will evict next are worth writing, and free frames go before them.
+	//Idle pages go first: their access was revoked and they have not been used since. A page still
+	//in use may be dirtied again after its write, so it is cleaned at most once while resident.
+	int i, n, mapped, bits;
+
+	if (pg->frames->nfree > 0) return -1;
+	n = pg->policy->next_victims(pg, pg->clean_order, pg->reserve);
+	for (i = 0; i < n; i++) {
+		struct frame *f = &pg->frames->frames[pg->clean_order[i]];
+		if (!f->dirty || f->referenced) continue;
+		page_table_get_entry(pg->pt, f->page, &mapped, &bits);
+		if (bits == 0) return pg->clean_order[i];
+	}
+	for (i = 0; i < n; i++) {
+		struct frame *f = &pg->frames->frames[pg->clean_order[i]];
+		if (f->dirty && !f->cleaned) return pg->clean_order[i];
+	}
+	return -1;
+}
+
+static void clean_frame(struct pager *pg, int frame) {
+	struct frame *f = &pg->frames->frames[frame];
+	int page = f->page, mapped, bits;
+
+	//Write protect before copying, so that a write after the copy faults and dirties the page again
+	page_table_get_entry(pg->pt, page, &mapped, &bits);
+	if (bits & PROT_WRITE) page_table_set_entry(pg->pt, page, frame, PROT_READ);
+	memcpy(pg->clean_buffer, &pg->physmem[frame*PAGE_SIZE], PAGE_SIZE);
+	f->dirty = 0;
+	f->cleaned = 1;
+
+	//Faults carry on during the write, on the copy's page too, since the frame is left alone
+	pg->cleaning_page = page;
+	pthread_mutex_unlock(&pg->lock);
+	disk_write(pg->disk, page, pg->clean_buffer);
+	pthread_mutex_lock(&pg->lock);
+	pg->cleaning_page = -1;
+
+	pg->disk_writes++;
+	pg->clean_writes++;
+	pthread_cond_broadcast(&pg->cleaned);
+}
+
+static void * cleaner_thread(void *arg) {
+	struct pager *pg = arg;
+
+	pthread_mutex_lock(&pg->lock);
+	while (!pg->cleaner_stop) {
+		int frame = next_to_clean(pg);
+		if (frame < 0) pthread_cond_wait(&pg->wake_cleaner, &pg->lock);
+		else clean_frame(pg, frame);
+	}
+	pthread_mutex_unlock(&pg->lock);
+	return 0;
+}
+
+struct pager * pager_create(const struct policy *policy, int npages, int nframes, struct disk *disk) {
+	struct pager *pg = calloc(1, sizeof(struct pager));
+	if (!pg) return 0;
+
+	pg->policy = policy;
+	pg->npages = npages;
+	pg->nframes = nframes;
+	pg->disk = disk;
+	pg->cleaning_page = -1;
+
+	pthread_mutex_init(&pg->lock, 0);
+	pthread_cond_init(&pg->wake_cleaner, 0);
+	pthread_cond_init(&pg->cleaned, 0);
+
+	pg->frames = frame_table_create(nframes);
+	pg->sample_queue = malloc(sizeof(int)*nframes);
+	if (!pg->frames || !pg->sample_queue || !policy->init(pg)) {
+		if (pg->frames) frame_table_delete(pg->frames);
+		free(pg->sample_queue);
+		free(pg);
+		return 0;
+	}
+
+	the_pager = pg;
+
+	pg->pt = page_table_create(npages, nframes, page_fault_handler);
+	if (!pg->pt) {
+		the_pager = 0;
+		if (policy->destroy) policy->destroy(pg);
+		frame_table_delete(pg->frames);
+		free(pg->sample_queue);
+		free(pg);
+		return 0;
+	}
+
+	pg->physmem = page_table_get_physmem(pg->pt);
+	return pg;
+}
+
+int pager_start_cleaner(struct pager *pg, int reserve) {
+	if (pg->cleaner_running || reserve <= 0 || !pg->policy->next_victims) return 0;
+
+	pg->reserve = (reserve < pg->nframes) ? reserve : pg->nframes;
+	pg->clean_order = malloc(sizeof(int)*pg->reserve);
+	pg->clean_buffer = malloc(PAGE_SIZE);
+	if (!pg->clean_order || !pg->clean_buffer) {
+		free(pg->clean_order);
+		free(pg->clean_buffer);
+		pg->clean_order = 0;
+		pg->clean_buffer = 0;
+		return 0;
+	}
+
+	pg->cleaner_stop = 0;
+	pg->cleaner_running = 1;
+	if (pthread_create(&pg->cleaner, 0, cleaner_thread, pg) != 0) {
+		pg->cleaner_running = 0;
+		return 0;
+	}
+	return 1;
+}
+
+void pager_stop_cleaner(struct pager *pg) {
+	if (!pg->cleaner_running) return;
+
+	pthread_mutex_lock(&pg->lock);
+	pg->cleaner_stop = 1;
+	pthread_cond_signal(&pg->wake_cleaner);
+	pthread_mutex_unlock(&pg->lock);
+
+	pthread_join(pg->cleaner, 0);
+	pg->cleaner_running = 0;
+}
+
+void pager_delete(struct pager *pg) {
+	pager_stop_cleaner(pg);
+	page_table_delete(pg->pt);
+	if (pg->policy->destroy) pg->policy->destroy(pg);
+	frame_table_delete(pg->frames);
+	free(pg->sample_queue);
+	free(pg->clean_order);
+	free(pg->clean_buffer);
+	pthread_mutex_destroy(&pg->lock);
+	pthread_cond_destroy(&pg->wake_cleaner);
+	pthread_cond_destroy(&pg->cleaned);
+	if (the_pager == pg) the_pager = 0;
+	free(pg);
+}
+
+void pager_clear_reference(struct pager *pg, int frame) {
+	struct frame *f = &pg->frames->frames[frame];
+	f->referenced = 0;
+	page_table_set_entry(pg->pt, f->page, frame, 0);
+}
+
+void pager_sample_later(struct pager *pg, int frame) {
+	pg->sample_queue[pg->nsamples++] = frame;
+}
+
+int pager_check(struct pager *pg) {
+	return frame_table_check(pg->frames, pg->pt);
+}
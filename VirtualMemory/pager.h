@@ -0,0 +1,92 @@
+#ifndef PAGER_H
+#define PAGER_H
+
+#include "page_table.h"
+#include "disk.h"
+#include "frame.h"
+#include "policy.h"
+
+#include <pthread.h>
+
+/*
+The pager services page faults: it keeps the frame table, moves pages between
+physical memory and the disk, and asks the replacement policy which frame to
+use. It creates the page table itself, so there is one pager per process.
+
+A pager may also run a cleaner thread, which writes dirty pages back before
+they are chosen for eviction. Faults and the cleaner take turns under "lock".
+*/
+
+struct pager {
+	struct page_table *pt;
+	struct disk *disk;
+	struct frame_table *frames;
+	char *physmem;
+	int npages, nframes;
+
+	const struct policy *policy;
+	void *state;
+
+	int *sample_queue;
+	int nsamples;
+
+	int page_faults, disk_reads, disk_writes, ref_faults;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake_cleaner;	/* a fault may have dirtied or used up the reserve */
+	pthread_cond_t cleaned;		/* the cleaner's write of cleaning_page finished */
+	pthread_t cleaner;
+	int cleaner_running, cleaner_stop;
+	int reserve;			/* frames the cleaner keeps clean ahead of eviction */
+	int cleaning_page;		/* page the cleaner is writing outside the lock, or -1 */
+	int *clean_order;
+	char *clean_buffer;
+	int clean_writes;		/* disk writes made by the cleaner, also in disk_writes */
+};
+
+/*
+Create a pager for "npages" pages of virtual memory and "nframes" frames,
+backed by "disk" and replacing pages with "policy". Returns null on failure.
+*/
+
+struct pager * pager_create( const struct policy *policy, int npages, int nframes, struct disk *disk );
+
+/*
+Start a thread that keeps the "reserve" frames the policy will evict next
+clean, writing dirty pages back and write protecting them so that a later
+write dirties them again. Eviction then only has to write a page dirtied since
+it was cleaned. Idle pages, whose access was revoked and not used since, are
+written first; a page still in use is written at most once while resident.
+Returns 1 on success, or 0 if the thread could not be started or the policy
+has no next_victims hook, as rand and custom do not.
+*/
+
+int pager_start_cleaner( struct pager *pg, int reserve );
+
+/* Stop the cleaner thread, if there is one, once its current write is done. */
+
+void pager_stop_cleaner( struct pager *pg );
+
+/* Delete a pager along with its page table, stopping the cleaner first. */
+
+void pager_delete( struct pager *pg );
+
+/*
+Clear the reference bit of the page in "frame" and revoke its access, so that
+its next use takes a reference fault, which sets the bit again.
+*/
+
+void pager_clear_reference( struct pager *pg, int frame );
+
+/*
+Revoke the access of the page in "frame" at the next miss, so that its next
+use after that is reported to the policy's on_access hook.
+*/
+
+void pager_sample_later( struct pager *pg, int frame );
+
+/* Check the frame table against the page table. Returns 1 if they agree. */
+
+int pager_check( struct pager *pg );
+
+#endif
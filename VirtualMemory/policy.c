@@ -0,0 +1,46 @@
+#include "policy.h"
+
+#include <stdio.h>
+#include <string.h>
+
+extern const struct policy policy_rand;
+extern const struct policy policy_fifo;
+extern const struct policy policy_custom;
+extern const struct policy policy_clock;
+extern const struct policy policy_clockpro;
+extern const struct policy policy_arc;
+extern const struct policy policy_2q;
+
+//A new policy is added here and to Makefile.txt
+static const struct policy *policies[] = {
+	&policy_rand,
+	&policy_fifo,
+	&policy_custom,
+	&policy_clock,
+	&policy_clockpro,
+	&policy_arc,
+	&policy_2q,
+	0
+};
+
+const struct policy * policy_lookup(const char *name) {
+	int i;
+	for (i = 0; policies[i]; i++) {
+		if (!strcmp(policies[i]->name, name)) return policies[i];
+	}
+	return 0;
+}
+
+const struct policy * policy_at(int index) {
+	int i;
+	for (i = 0; i < index && policies[i]; i++);
+	return policies[i];
+}
+
+void policy_names(char *buffer, int length, const char *sep) {
+	int i, used = 0;
+	buffer[0] = 0;
+	for (i = 0; policies[i] && used < length; i++) {
+		used += snprintf(buffer + used, length - used, "%s%s", i ? sep : "", policies[i]->name);
+	}
+}
@@ -0,0 +1,58 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+struct pager;
+
+/*
+A page replacement policy. The pager calls the hooks around each fault, and a
+policy keeps whatever it needs in the state it puts in pg->state. Only
+on_fault is required; any other hook may be left null.
+*/
+
+struct policy {
+	const char *name;
+
+	/* Set up pg->state. Returns 1 on success and 0 on failure. */
+	int (*init)( struct pager *pg );
+
+	/* Free pg->state. */
+	void (*destroy)( struct pager *pg );
+
+	/*
+	"page" is not resident. "frame" is the free frame it will be loaded into,
+	or -1 if every frame is in use, in which case the policy picks the frame to
+	evict. Returns the frame the page goes into.
+	*/
+	int (*on_fault)( struct pager *pg, int page, int frame );
+
+	/* "page" has been loaded into "frame" after on_fault returned. */
+	void (*on_load)( struct pager *pg, int page, int frame );
+
+	/* "page" has been evicted from "frame" to make room for a fault. */
+	void (*on_evict)( struct pager *pg, int page, int frame );
+
+	/* "page", resident in "frame", was used after its access was revoked. */
+	void (*on_access)( struct pager *pg, int page, int frame );
+
+	/*
+	Write up to "count" frames to "frames" in the order the policy expects to
+	evict them, without changing its state, and return how many. Only called
+	once every frame is in use. The cleaner writes back these frames, so a
+	policy without this hook cannot have one.
+	*/
+	int (*next_victims)( struct pager *pg, int *frames, int count );
+};
+
+/* Find a policy by name, or return null if there is none. */
+
+const struct policy * policy_lookup( const char *name );
+
+/* Return the policy at "index" in the registry, or null past the last one. */
+
+const struct policy * policy_at( int index );
+
+/* Write the names of all policies to "buffer", separated by "sep". */
+
+void policy_names( char *buffer, int length, const char *sep );
+
+#endif
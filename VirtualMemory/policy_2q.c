@@ -0,0 +1,100 @@
+#include "pager.h"
+#include "page_list.h"
+
+#include <stdlib.h>
+
+//2Q: new pages enter the FIFO A1in, and only pages reused after falling out of it (while still
+//remembered in A1out) are promoted to the LRU list Am, so a single scan cannot flush Am
+
+struct twoq_state {
+	struct list_node *nodes;
+	struct page_list a1in, a1out, am;
+	int kin, kout;
+	int admit_am;		//the page being loaded was remembered in A1out
+};
+
+static int twoq_init(struct pager *pg) {
+	struct twoq_state *s = calloc(1, sizeof(struct twoq_state));
+	if (!s) return 0;
+
+	s->nodes = calloc(pg->npages, sizeof(struct list_node));
+	if (!s->nodes) {
+		free(s);
+		return 0;
+	}
+	list_init(&s->a1in);
+	list_init(&s->a1out);
+	list_init(&s->am);
+	s->kin = (pg->nframes/4 > 0) ? pg->nframes/4 : 1;
+	s->kout = (pg->nframes/2 > 0) ? pg->nframes/2 : 1;
+
+	pg->state = s;
+	return 1;
+}
+
+static void twoq_destroy(struct pager *pg) {
+	struct twoq_state *s = pg->state;
+	free(s->nodes);
+	free(s);
+}
+
+static int twoq_fault(struct pager *pg, int page, int frame) {
+	struct twoq_state *s = pg->state;
+
+	s->admit_am = (s->nodes[page].list == &s->a1out);
+	if (s->admit_am) list_remove(s->nodes, page);
+
+	if (frame >= 0) return frame;
+
+	if (s->a1in.size > s->kin || s->am.size == 0) {
+		page = list_pop(s->nodes, &s->a1in);
+		frame = s->nodes[page].frame;
+		list_push(s->nodes, &s->a1out, page);
+		if (s->a1out.size > s->kout) list_pop(s->nodes, &s->a1out);
+	} else {
+		page = list_pop(s->nodes, &s->am);
+		frame = s->nodes[page].frame;
+	}
+	return frame;
+}
+
+static void twoq_load(struct pager *pg, int page, int frame) {
+	//Only reuse within Am matters, so pages in A1in are never sampled
+	struct twoq_state *s = pg->state;
+	s->nodes[page].frame = frame;
+	if (s->admit_am) {
+		list_push(s->nodes, &s->am, page);
+		pager_sample_later(pg, frame);
+	} else {
+		list_push(s->nodes, &s->a1in, page);
+	}
+}
+
+static void twoq_access(struct pager *pg, int page, int frame) {
+	struct twoq_state *s = pg->state;
+	if (s->nodes[page].list == &s->am) {
+		list_remove(s->nodes, page);
+		list_push(s->nodes, &s->am, page);
+		pager_sample_later(pg, frame);
+	}
+}
+
+static int twoq_next_victims(struct pager *pg, int *frames, int count) {
+	//A1in gives up its pages beyond kin first, then Am its least recent ones
+	struct twoq_state *s = pg->state;
+	if (s->am.size == 0) return list_oldest(s->nodes, &s->a1in, frames, count);
+
+	int over = (s->a1in.size > s->kin) ? s->a1in.size - s->kin : 0;
+	int n = list_oldest(s->nodes, &s->a1in, frames, (over < count) ? over : count);
+	return n + list_oldest(s->nodes, &s->am, frames + n, count - n);
+}
+
+const struct policy policy_2q = {
+	.name = "2q",
+	.init = twoq_init,
+	.destroy = twoq_destroy,
+	.on_fault = twoq_fault,
+	.on_load = twoq_load,
+	.on_access = twoq_access,
+	.next_victims = twoq_next_victims,
+};
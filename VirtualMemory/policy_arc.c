@@ -0,0 +1,123 @@
+#include "pager.h"
+#include "page_list.h"
+
+#include <stdlib.h>
+
+//ARC: T1 holds pages used once recently and T2 pages used at least twice. B1 and B2 remember the
+//pages evicted from each, and a miss on a remembered page moves the target size of T1 toward
+//the list that would have kept it.
+
+struct arc_state {
+	struct list_node *nodes;
+	struct page_list t1, t2, b1, b2;
+	int p;
+	int admit_t2;		//the page being loaded was found in a ghost list
+};
+
+static int arc_replace(struct arc_state *s, int in_b2) {
+	//Evict the LRU page of T1 or T2, keeping it as a ghost, and return its frame
+	int page;
+	if (s->t1.size > 0 && (s->t1.size > s->p || (in_b2 && s->t1.size == s->p))) {
+		page = list_pop(s->nodes, &s->t1);
+		list_push(s->nodes, &s->b1, page);
+	} else {
+		page = list_pop(s->nodes, &s->t2);
+		list_push(s->nodes, &s->b2, page);
+	}
+	return s->nodes[page].frame;
+}
+
+static int arc_init(struct pager *pg) {
+	struct arc_state *s = calloc(1, sizeof(struct arc_state));
+	if (!s) return 0;
+
+	s->nodes = calloc(pg->npages, sizeof(struct list_node));
+	if (!s->nodes) {
+		free(s);
+		return 0;
+	}
+	list_init(&s->t1);
+	list_init(&s->t2);
+	list_init(&s->b1);
+	list_init(&s->b2);
+
+	pg->state = s;
+	return 1;
+}
+
+static void arc_destroy(struct pager *pg) {
+	struct arc_state *s = pg->state;
+	free(s->nodes);
+	free(s);
+}
+
+static int arc_fault(struct pager *pg, int page, int frame) {
+	struct arc_state *s = pg->state;
+	struct page_list *ghost = s->nodes[page].list;
+	int nframes = pg->nframes;
+	int total = s->t1.size + s->t2.size + s->b1.size + s->b2.size;
+	int delta;
+
+	s->admit_t2 = (ghost != 0);
+
+	if (frame >= 0) {
+		if (ghost) list_remove(s->nodes, page);
+		return frame;
+	}
+
+	if (ghost == &s->b1) {
+		delta = (s->b2.size > s->b1.size) ? s->b2.size / s->b1.size : 1;
+		s->p = (s->p + delta < nframes) ? s->p + delta : nframes;
+		list_remove(s->nodes, page);
+		return arc_replace(s, 0);
+	} else if (ghost == &s->b2) {
+		delta = (s->b1.size > s->b2.size) ? s->b1.size / s->b2.size : 1;
+		s->p = (s->p - delta > 0) ? s->p - delta : 0;
+		list_remove(s->nodes, page);
+		return arc_replace(s, 1);
+	} else if (s->t1.size + s->b1.size == nframes) {
+		if (s->t1.size < nframes) {
+			list_pop(s->nodes, &s->b1);
+			return arc_replace(s, 0);
+		}
+		//B1 is empty, so T1's LRU page is dropped without a ghost
+		return s->nodes[list_pop(s->nodes, &s->t1)].frame;
+	} else {
+		if (total == 2*nframes) list_pop(s->nodes, &s->b2);
+		return arc_replace(s, 0);
+	}
+}
+
+static void arc_load(struct pager *pg, int page, int frame) {
+	struct arc_state *s = pg->state;
+	s->nodes[page].frame = frame;
+	list_push(s->nodes, s->admit_t2 ? &s->t2 : &s->t1, page);
+	pager_sample_later(pg, frame);
+}
+
+static void arc_access(struct pager *pg, int page, int frame) {
+	struct arc_state *s = pg->state;
+	list_remove(s->nodes, page);
+	list_push(s->nodes, &s->t2, page);
+	pager_sample_later(pg, frame);
+}
+
+static int arc_next_victims(struct pager *pg, int *frames, int count) {
+	//T1 gives up its pages beyond the target first, then T2 its least recent ones
+	struct arc_state *s = pg->state;
+	if (s->t2.size == 0) return list_oldest(s->nodes, &s->t1, frames, count);
+
+	int over = (s->t1.size > s->p) ? s->t1.size - s->p : 0;
+	int n = list_oldest(s->nodes, &s->t1, frames, (over < count) ? over : count);
+	return n + list_oldest(s->nodes, &s->t2, frames + n, count - n);
+}
+
+const struct policy policy_arc = {
+	.name = "arc",
+	.init = arc_init,
+	.destroy = arc_destroy,
+	.on_fault = arc_fault,
+	.on_load = arc_load,
+	.on_access = arc_access,
+	.next_victims = arc_next_victims,
+};
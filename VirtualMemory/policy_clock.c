@@ -0,0 +1,54 @@
+#include "pager.h"
+
+#include <stdlib.h>
+
+//Second chance: the hand passes over referenced frames, clearing them, and takes the first
+//unreferenced one. Clearing a bit revokes the page's access, so a later use sets it again.
+
+struct clock_state {
+	int hand;
+};
+
+static int clock_init(struct pager *pg) {
+	pg->state = calloc(1, sizeof(struct clock_state));
+	return pg->state != 0;
+}
+
+static void clock_destroy(struct pager *pg) {
+	free(pg->state);
+}
+
+static int clock_fault(struct pager *pg, int page, int frame) {
+	struct clock_state *s = pg->state;
+	if (frame >= 0) return frame;
+
+	while (pg->frames->frames[s->hand].referenced != 0) {
+		pager_clear_reference(pg, s->hand);
+		s->hand++;
+		s->hand %= pg->nframes;
+	}
+
+	frame = s->hand;
+	s->hand++;
+	s->hand %= pg->nframes;
+	return frame;
+}
+
+static int clock_next_victims(struct pager *pg, int *frames, int count) {
+	//One sweep of the hand: the referenced frames it would clear on the way are passed over
+	struct clock_state *s = pg->state;
+	int i, n = 0;
+	for (i = 0; i < pg->nframes && n < count; i++) {
+		int frame = (s->hand + i) % pg->nframes;
+		if (!pg->frames->frames[frame].referenced) frames[n++] = frame;
+	}
+	return n;
+}
+
+const struct policy policy_clock = {
+	.name = "clock",
+	.init = clock_init,
+	.destroy = clock_destroy,
+	.on_fault = clock_fault,
+	.next_victims = clock_next_victims,
+};
@@ -0,0 +1,221 @@
+#include "pager.h"
+
+#include <stdlib.h>
+
+//CLOCK-Pro keeps hot and cold resident pages, and cold pages recently evicted, on one clock.
+//A cold page reused within its test period becomes hot, and the share of frames given to
+//cold pages grows when evicted test pages come back and shrinks when test periods run out.
+
+#define CP_LISTED   1
+#define CP_HOT      2
+#define CP_TEST     4
+#define CP_RESIDENT 8
+
+struct cp_page {
+	int prev, next;
+	int frame;
+	int flags;
+};
+
+struct clockpro_state {
+	struct cp_page *pages;
+	int hand_hot, hand_cold, hand_test;
+	int hot, cold, nonresident, cold_target;
+	int admit_hot;		//the page being loaded returned within its test period
+};
+
+static void cp_link(struct clockpro_state *s, int page, int flags) {
+	//The list head, where pages are added, is just behind the hot hand
+	struct cp_page *p = &s->pages[page];
+	if (s->hand_hot < 0) {
+		p->prev = p->next = page;
+		s->hand_hot = s->hand_cold = s->hand_test = page;
+	} else {
+		p->next = s->hand_hot;
+		p->prev = s->pages[s->hand_hot].prev;
+		s->pages[p->prev].next = page;
+		s->pages[p->next].prev = page;
+	}
+	p->flags = flags | CP_LISTED;
+}
+
+static void cp_unlink(struct clockpro_state *s, int page) {
+	struct cp_page *p = &s->pages[page];
+	int next = (p->next == page) ? -1 : p->next;
+
+	s->pages[p->prev].next = p->next;
+	s->pages[p->next].prev = p->prev;
+	if (s->hand_hot == page) s->hand_hot = next;
+	if (s->hand_cold == page) s->hand_cold = next;
+	if (s->hand_test == page) s->hand_test = next;
+	p->flags = 0;
+}
+
+static void cp_end_test(struct clockpro_state *s, int page) {
+	//A test period that ran out without reuse argues for fewer cold frames
+	s->pages[page].flags &= ~CP_TEST;
+	if (s->cold_target > 1) s->cold_target--;
+	if (!(s->pages[page].flags & CP_RESIDENT)) {
+		cp_unlink(s, page);
+		s->nonresident--;
+	}
+}
+
+static void cp_run_hot(struct pager *pg, struct clockpro_state *s) {
+	//Demote the first unreferenced hot page, ending the test periods of cold pages on the way
+	while (1) {
+		int page = s->hand_hot;
+		struct cp_page *p = &s->pages[page];
+		s->hand_hot = p->next;
+
+		if (p->flags & CP_HOT) {
+			if (pg->frames->frames[p->frame].referenced) {
+				pager_clear_reference(pg, p->frame);
+			} else {
+				p->flags &= ~CP_HOT;
+				s->hot--;
+				s->cold++;
+				return;
+			}
+		} else if (p->flags & CP_TEST) {
+			cp_end_test(s, page);
+		}
+	}
+}
+
+static void cp_run_test(struct clockpro_state *s) {
+	//Forget the oldest non-resident test page
+	while (1) {
+		int page = s->hand_test;
+		struct cp_page *p = &s->pages[page];
+		s->hand_test = p->next;
+
+		if ((p->flags & (CP_HOT|CP_TEST)) == CP_TEST) {
+			int resident = p->flags & CP_RESIDENT;
+			cp_end_test(s, page);
+			if (!resident) return;
+		}
+	}
+}
+
+static void cp_balance(struct pager *pg, struct clockpro_state *s) {
+	while (s->hot > pg->nframes - s->cold_target) cp_run_hot(pg, s);
+}
+
+static int cp_run_cold(struct pager *pg, struct clockpro_state *s) {
+	//Find an unreferenced cold resident page to evict and return its frame
+	while (1) {
+		int page = s->hand_cold;
+		struct cp_page *p = &s->pages[page];
+		s->hand_cold = p->next;
+
+		if ((p->flags & (CP_HOT|CP_RESIDENT)) != CP_RESIDENT) continue;
+
+		if (pg->frames->frames[p->frame].referenced) {
+			int flags = p->flags;
+			pager_clear_reference(pg, p->frame);
+			cp_unlink(s, page);
+			if (flags & CP_TEST) {
+				//Reused within its test period
+				cp_link(s, page, CP_RESIDENT|CP_HOT);
+				s->cold--;
+				s->hot++;
+				cp_balance(pg, s);
+			} else {
+				cp_link(s, page, CP_RESIDENT|CP_TEST);
+			}
+		} else {
+			//Evicted test pages stay on the clock, without a frame, until their test period ends
+			int frame = p->frame;
+			if (p->flags & CP_TEST) {
+				p->flags &= ~CP_RESIDENT;
+				s->nonresident++;
+			} else {
+				cp_unlink(s, page);
+			}
+			s->cold--;
+			while (s->nonresident > pg->nframes) cp_run_test(s);
+			return frame;
+		}
+	}
+}
+
+static int clockpro_init(struct pager *pg) {
+	struct clockpro_state *s = calloc(1, sizeof(struct clockpro_state));
+	if (!s) return 0;
+
+	s->pages = calloc(pg->npages, sizeof(struct cp_page));
+	if (!s->pages) {
+		free(s);
+		return 0;
+	}
+	s->hand_hot = s->hand_cold = s->hand_test = -1;
+	s->cold_target = pg->nframes;
+
+	pg->state = s;
+	return 1;
+}
+
+static void clockpro_destroy(struct pager *pg) {
+	struct clockpro_state *s = pg->state;
+	free(s->pages);
+	free(s);
+}
+
+static int clockpro_fault(struct pager *pg, int page, int frame) {
+	struct clockpro_state *s = pg->state;
+
+	//A faulting page still on the clock is a non-resident page back within its test period
+	s->admit_hot = 0;
+	if (s->pages[page].flags & CP_LISTED) {
+		if (s->cold_target < pg->nframes) s->cold_target++;
+		cp_unlink(s, page);
+		s->nonresident--;
+		s->admit_hot = 1;
+	}
+
+	if (frame >= 0) return frame;
+	return cp_run_cold(pg, s);
+}
+
+static void clockpro_load(struct pager *pg, int page, int frame) {
+	struct clockpro_state *s = pg->state;
+
+	//A page only counts as referenced if it is used again after the access that loaded it
+	s->pages[page].frame = frame;
+	pg->frames->frames[frame].referenced = 0;
+	pager_sample_later(pg, frame);
+
+	if (s->admit_hot) {
+		cp_link(s, page, CP_RESIDENT|CP_HOT);
+		s->hot++;
+		cp_balance(pg, s);
+	} else {
+		cp_link(s, page, CP_RESIDENT|CP_TEST);
+		s->cold++;
+	}
+}
+
+static int clockpro_next_victims(struct pager *pg, int *frames, int count) {
+	//The unreferenced cold resident pages ahead of the cold hand, in one trip round the clock
+	struct clockpro_state *s = pg->state;
+	int page = s->hand_cold, n = 0;
+	if (page < 0) return 0;
+	do {
+		struct cp_page *p = &s->pages[page];
+		if ((p->flags & (CP_HOT|CP_RESIDENT)) == CP_RESIDENT && !pg->frames->frames[p->frame].referenced) {
+			frames[n++] = p->frame;
+		}
+		page = p->next;
+	} while (page != s->hand_cold && n < count);
+	return n;
+}
+
+const struct policy policy_clockpro = {
+	.name = "clockpro",
+	.init = clockpro_init,
+	.destroy = clockpro_destroy,
+	.on_fault = clockpro_fault,
+	.on_load = clockpro_load,
+	.next_victims = clockpro_next_victims,
+};
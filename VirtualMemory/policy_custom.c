@@ -0,0 +1,112 @@
+#include "pager.h"
+
+#include <stdlib.h>
+
+//Policy implements LRU with a clock style structure, switching to random if a cycle_threshold is exceeded in the page history
+
+struct custom_state {
+	int index;
+	int match_counter;
+	int *page_history;
+	int page_history_count;
+	int cycle_thresh;
+	int detected_cycles;
+	int rand_switch;
+};
+
+static int custom_init(struct pager *pg) {
+	struct custom_state *s = calloc(1, sizeof(struct custom_state));
+	if (!s) return 0;
+
+	s->page_history = malloc(sizeof(int)*pg->npages);
+	if (!s->page_history) {
+		free(s);
+		return 0;
+	}
+	s->cycle_thresh = 2;
+
+	pg->state = s;
+	return 1;
+}
+
+static void custom_destroy(struct pager *pg) {
+	struct custom_state *s = pg->state;
+	free(s->page_history);
+	free(s);
+}
+
+static void record_page(struct pager *pg, struct custom_state *s, int page) {
+	int npages = pg->npages;
+
+	if (s->page_history_count >= npages) {
+
+		if (page == s->page_history[0]) {
+			//Current page occured 1 cycle ago
+			s->match_counter++;
+		} else {
+			//Pattern broken
+			s->match_counter = 0;
+			s->detected_cycles = 0;
+		}
+
+		if (s->match_counter == npages) {
+			//All pages of the cycle match
+			s->match_counter = 0;
+			s->detected_cycles++;
+		}
+
+		if (s->detected_cycles == s->cycle_thresh) {
+			s->rand_switch = 1;
+		}
+
+		//Shift the page history left
+		int j;
+		for (j = 0; j < npages - 1; j++) {
+			s->page_history[j] = s->page_history[j + 1];
+		}
+		s->page_history[npages-1] = page;
+	}else{
+		//Finish populating page history
+		s->page_history[s->page_history_count] = page;
+		s->page_history_count++;
+
+	}
+}
+
+static int custom_fault(struct pager *pg, int page, int frame) {
+	struct custom_state *s = pg->state;
+
+	if (frame >= 0) {
+		if (s->page_history_count < pg->npages) {
+			s->page_history[s->page_history_count] = page;
+			s->page_history_count++;
+		}
+		return frame;
+	}
+
+	if (s->rand_switch) {
+		s->index = rand() % pg->nframes;
+		return s->index;
+	}
+
+	record_page(pg, s, page);
+
+	while (pg->frames->frames[s->index].referenced != 0) {
+		pg->frames->frames[s->index].referenced = 0;
+		s->index++;
+		s->index %= pg->nframes;
+	}
+
+	frame = s->index;
+
+	s->index += 2;
+	s->index %= pg->nframes;
+	return frame;
+}
+
+const struct policy policy_custom = {
+	.name = "custom",
+	.init = custom_init,
+	.destroy = custom_destroy,
+	.on_fault = custom_fault,
+};
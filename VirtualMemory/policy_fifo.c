@@ -0,0 +1,45 @@
+#include "pager.h"
+
+#include <stdlib.h>
+
+//First in, first out: frames are filled lowest first, so they are also replaced in frame order
+
+struct fifo_state {
+	int index;
+};
+
+static int fifo_init(struct pager *pg) {
+	pg->state = calloc(1, sizeof(struct fifo_state));
+	return pg->state != 0;
+}
+
+static void fifo_destroy(struct pager *pg) {
+	free(pg->state);
+}
+
+static int fifo_fault(struct pager *pg, int page, int frame) {
+	struct fifo_state *s = pg->state;
+	if (frame >= 0) return frame;
+
+	frame = s->index;
+	s->index++;
+	s->index %= pg->nframes;
+	return frame;
+}
+
+static int fifo_next_victims(struct pager *pg, int *frames, int count) {
+	struct fifo_state *s = pg->state;
+	int i;
+	for (i = 0; i < count && i < pg->nframes; i++) {
+		frames[i] = (s->index + i) % pg->nframes;
+	}
+	return i;
+}
+
+const struct policy policy_fifo = {
+	.name = "fifo",
+	.init = fifo_init,
+	.destroy = fifo_destroy,
+	.on_fault = fifo_fault,
+	.next_victims = fifo_next_victims,
+};
@@ -0,0 +1,21 @@
+#include "pager.h"
+
+#include <stdlib.h>
+
+//Random replacement: any frame may go
+
+static int rand_init(struct pager *pg) {
+	pg->state = 0;
+	return 1;
+}
+
+static int rand_fault(struct pager *pg, int page, int frame) {
+	if (frame >= 0) return frame;
+	return rand() % pg->nframes;
+}
+
+const struct policy policy_rand = {
+	.name = "rand",
+	.init = rand_init,
+	.on_fault = rand_fault,
+};
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+#include "page_table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#define TRACE_BUFFER 65536
+
+//x86 trap flag: the instruction a signal returns to runs one step and traps
+#define TRAP_FLAG 0x100
+
+//Recording keeps only the page in use accessible, so every move to another page faults
+static FILE *trace_file;
+static unsigned char trace_buffer[TRACE_BUFFER];
+static int trace_buffered;
+static int64_t trace_count;
+static int trace_failed;
+static char *record_memory;
+static int record_npages;
+static int current_page = -1;
+static int held_page = -1;
+static int last_page;
+
+static void trace_flush(void) {
+	if (trace_buffered && fwrite(trace_buffer, 1, trace_buffered, trace_file) != trace_buffered) {
+		trace_failed = 1;
+	}
+	trace_buffered = 0;
+}
+
+static void trace_append(int page, int write) {
+	int64_t delta = (int64_t)page - last_page;
+	uint64_t value = ((uint64_t)((delta << 1) ^ (delta >> 63)) << 1) | write;
+	last_page = page;
+
+	if (trace_buffered > TRACE_BUFFER - 10) trace_flush();
+	while (value >= 0x80) {
+		trace_buffer[trace_buffered++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	trace_buffer[trace_buffered++] = value;
+	trace_count++;
+}
+
+static void record_protect(int page, int bits) {
+	mprotect(record_memory + (size_t)page*PAGE_SIZE, PAGE_SIZE, bits);
+}
+
+static void record_fault(int signum, siginfo_t *info, void *context) {
+	ucontext_t *uc = context;
+	int64_t offset = (char *)info->si_addr - record_memory;
+
+	if (offset < 0 || offset >= (int64_t)record_npages*PAGE_SIZE) {
+		fprintf(stderr, "segmentation fault at address %p\n", info->si_addr);
+		abort();
+	}
+
+	//The page in use is mapped at least read-only, so a fault on it is a write
+	int page = offset / PAGE_SIZE;
+	int write = (page == current_page);
+#ifdef REG_ERR
+	if (uc->uc_mcontext.gregs[REG_ERR] & 2) write = 1;
+#endif
+
+	trace_append(page, write);
+	if (page == current_page) {
+		record_protect(page, PROT_READ|PROT_WRITE);
+		return;
+	}
+
+	//One instruction can touch two pages, as a copy across a page boundary does.
+	//The page it left stays open until it completes, or it would fault forever.
+	//Without a trap flag to step it, the page stays open until the next fault.
+	if (held_page >= 0 && held_page != page) record_protect(held_page, PROT_NONE);
+	held_page = current_page;
+	current_page = page;
+
+	//A read maps the page read-only, so a later write to it is seen too
+	record_protect(page, write ? (PROT_READ|PROT_WRITE) : PROT_READ);
+#ifdef REG_EFL
+	if (held_page >= 0) uc->uc_mcontext.gregs[REG_EFL] |= TRAP_FLAG;
+#endif
+}
+
+static void record_step(int signum, siginfo_t *info, void *context) {
+#ifdef REG_EFL
+	ucontext_t *uc = context;
+	uc->uc_mcontext.gregs[REG_EFL] &= ~TRAP_FLAG;
+#endif
+	if (held_page >= 0) record_protect(held_page, PROT_NONE);
+	held_page = -1;
+}
+
+int64_t trace_record(const char *filename, int npages, void (*program)(char *data, int length)) {
+	struct trace_header header;
+	struct sigaction sa, old_segv, old_trap;
+
+	trace_file = fopen(filename, "wb");
+	if (!trace_file) {
+		fprintf(stderr, "couldn't create %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.npages = npages;
+	fwrite(TRACE_MAGIC, 1, 8, trace_file);
+	fwrite(&header, sizeof(header), 1, trace_file);
+
+	//Each page has memory of its own, so nothing is ever evicted
+	record_memory = mmap(0, (size_t)npages*PAGE_SIZE, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (record_memory == MAP_FAILED) {
+		fprintf(stderr, "couldn't map %d pages: %s\n", npages, strerror(errno));
+		fclose(trace_file);
+		return -1;
+	}
+	record_npages = npages;
+
+	trace_buffered = 0;
+	trace_count = 0;
+	trace_failed = 0;
+	current_page = -1;
+	held_page = -1;
+	last_page = 0;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO;
+	sigfillset(&sa.sa_mask);
+	sa.sa_sigaction = record_fault;
+	sigaction(SIGSEGV, &sa, &old_segv);
+	sa.sa_sigaction = record_step;
+	sigaction(SIGTRAP, &sa, &old_trap);
+
+	program(record_memory, npages*PAGE_SIZE);
+
+	sigaction(SIGSEGV, &old_segv, 0);
+	sigaction(SIGTRAP, &old_trap, 0);
+	munmap(record_memory, (size_t)npages*PAGE_SIZE);
+
+	trace_flush();
+	if (fclose(trace_file) != 0 || trace_failed) {
+		fprintf(stderr, "couldn't write %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	return trace_count;
+}
+
+uint32_t * trace_load(const char *filename, int *npages, int64_t *count) {
+	struct trace_header header;
+	char magic[8];
+	unsigned char *bytes;
+	uint32_t *refs;
+	long size, i;
+
+	FILE *file = fopen(filename, "rb");
+	if (!file) {
+		fprintf(stderr, "couldn't open %s: %s\n", filename, strerror(errno));
+		return 0;
+	}
+
+	if (fread(magic, 1, 8, file) != 8 || memcmp(magic, TRACE_MAGIC, 8) || fread(&header, sizeof(header), 1, file) != 1 || header.npages <= 0) {
+		fprintf(stderr, "%s is not a page trace\n", filename);
+		fclose(file);
+		return 0;
+	}
+
+	fseek(file, 0, SEEK_END);
+	size = ftell(file) - 8 - sizeof(header);
+	fseek(file, 8 + sizeof(header), SEEK_SET);
+
+	bytes = malloc(size ? size : 1);
+	if (!bytes || fread(bytes, 1, size, file) != size) {
+		fprintf(stderr, "couldn't read %s\n", filename);
+		free(bytes);
+		fclose(file);
+		return 0;
+	}
+	fclose(file);
+
+	//Every reference ends in the one byte of its varint without the high bit
+	int64_t n = 0;
+	for (i = 0; i < size; i++) {
+		if (!(bytes[i] & 0x80)) n++;
+	}
+
+	refs = malloc(n ? n * sizeof(uint32_t) : 1);
+	if (!refs) {
+		fprintf(stderr, "out of memory for %lld references\n", (long long)n);
+		free(bytes);
+		return 0;
+	}
+
+	int64_t page = 0, j = 0;
+	uint64_t value = 0;
+	int shift = 0;
+	for (i = 0; i < size; i++) {
+		value |= (uint64_t)(bytes[i] & 0x7f) << shift;
+		shift += 7;
+		if (bytes[i] & 0x80) {
+			if (shift < 64) continue;
+			break;
+		}
+
+		uint64_t zigzag = value >> 1;
+		page += (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+		if (page < 0 || page >= header.npages) break;
+		refs[j++] = ((uint32_t)page << 1) | (value & 1);
+		value = 0;
+		shift = 0;
+	}
+	free(bytes);
+
+	if (j != n) {
+		fprintf(stderr, "%s is corrupt after %lld references\n", filename, (long long)j);
+		free(refs);
+		return 0;
+	}
+
+	*npages = header.npages;
+	*count = n;
+	return refs;
+}
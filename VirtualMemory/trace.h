@@ -0,0 +1,44 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+A page reference trace: the 8 bytes of TRACE_MAGIC, a struct trace_header in
+host byte order, then one varint per reference. Each varint holds the
+zigzag-encoded difference from the previous reference's page, shifted left by
+one, with the low bit set for a write, so most references take one byte.
+Loaded in memory, a reference is a 32-bit page number shifted left by one,
+with the low bit set for a write.
+
+Only the references that can change what a pager does are kept: the first
+access to a page after an access to another page, and the first write to a
+page after it was read. Replaying them against any policy faults exactly as
+the program did when run live with that policy.
+*/
+
+#define TRACE_MAGIC "VMTRACE1"
+
+struct trace_header {
+	int32_t npages;
+	int32_t reserved;
+};
+
+#define TRACE_PAGE(ref)  ((int)((ref) >> 1))
+#define TRACE_WRITE(ref) ((ref) & 1)
+
+/*
+Run "program" over "npages" pages of virtual memory and write its references
+to "filename". Returns the number of references, or -1 on failure.
+*/
+
+int64_t trace_record( const char *filename, int npages, void (*program)( char *data, int length ) );
+
+/*
+Read a whole trace into memory. Fills in the number of pages and references
+and returns the references, which the caller frees, or null on failure.
+*/
+
+uint32_t * trace_load( const char *filename, int *npages, int64_t *count );
+
+#endif
@@ -0,0 +1,173 @@
+/*
+Trace-driven simulator for the virtual memory project.
+Replays a page reference trace recorded with "virtmem record" through the
+same pager and replacement policies as virtmem, with a simulated page
+table and disk, and reports what each policy would have done.
+*/
+
+#include "pager.h"
+#include "policy.h"
+#include "trace.h"
+#include "page_table_sim.h"
+#include "opt.h"
+#include "mrc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int simulate(const struct policy *policy, const uint32_t *refs, int64_t count, int npages, int nframes) {
+	int64_t i;
+
+	struct disk *disk = disk_open("simulated", npages);
+	if (!disk) {
+		fprintf(stderr, "couldn't create simulated disk\n");
+		return 0;
+	}
+
+	//rand and custom draw from rand(), which a live run never seeds
+	srand(1);
+
+	struct pager *pager = pager_create(policy, npages, nframes, disk);
+	if (!pager) {
+		fprintf(stderr, "couldn't create pager for %s\n", policy->name);
+		disk_close(disk);
+		return 0;
+	}
+
+	double start = now();
+	for (i = 0; i < count; i++) {
+		page_table_sim_access(pager->pt, TRACE_PAGE(refs[i]), TRACE_WRITE(refs[i]) ? PROT_WRITE : PROT_READ);
+	}
+	double elapsed = now() - start;
+
+	printf("%-10s %10d %10d %10d %10d %10.1f\n", policy->name,
+		pager->page_faults, pager->disk_reads, pager->disk_writes, pager->ref_faults,
+		elapsed > 0 ? count / elapsed / 1e6 : 0);
+
+	if (!pager_check(pager)) {
+		fprintf(stderr, "%s: frame table is inconsistent with the page table\n", policy->name);
+	}
+
+	pager_delete(pager);
+	disk_close(disk);
+	return 1;
+}
+
+static void simulate_opt(const uint32_t *refs, int64_t count, int npages, int nframes) {
+	struct opt_result result;
+
+	double start = now();
+	if (!opt_simulate(refs, count, npages, nframes, &result)) {
+		fprintf(stderr, "opt: out of memory\n");
+		return;
+	}
+	double elapsed = now() - start;
+
+	printf("%-10s %10d %10d %10d %10s %10.1f\n", "opt",
+		result.page_faults, result.disk_reads, result.disk_writes, "-",
+		elapsed > 0 ? count / elapsed / 1e6 : 0);
+}
+
+static int miss_ratio_curve(int argc, char *argv[]) {
+	//Print LRU's misses for every number of frames as CSV, from one pass over the trace
+	int npages, c;
+	int64_t count;
+
+	if (argc < 3 || argc > 5 || (argc == 5 && strcmp(argv[4], "check"))) {
+		printf("use: virtsim mrc <tracefile> [rate [check]]\n");
+		return 1;
+	}
+
+	double rate = (argc >= 4) ? atof(argv[3]) : 1;
+	if (rate <= 0 || rate > 1) {
+		fprintf(stderr, "rate must be above 0 and at most 1\n");
+		return 1;
+	}
+
+	uint32_t *refs = trace_load(argv[2], &npages, &count);
+	if (!refs) return 1;
+
+	double *misses = malloc((npages + 1) * sizeof(double));
+	if (!misses || !mrc_compute(refs, count, npages, rate, misses)) {
+		fprintf(stderr, "mrc: out of memory\n");
+		free(misses);
+		free(refs);
+		return 1;
+	}
+
+	printf("frames,misses,miss_ratio\n");
+	for (c = 1; c <= npages; c++) {
+		printf("%d,%.0f,%.6f\n", c, misses[c], count ? misses[c] / count : 0);
+	}
+
+	//Optionally compare against the exact curve, to see what sampling at this rate costs
+	int ok = (argc == 5) ? mrc_check(refs, count, npages, rate, misses) : 1;
+
+	free(misses);
+	free(refs);
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+	char names[256];
+	int npages, nframes, i;
+	int64_t count;
+
+	if (argc > 1 && !strcmp(argv[1], "mrc")) {
+		return miss_ratio_curve(argc, argv);
+	}
+
+	if (argc < 3) {
+		policy_names(names, sizeof(names), "|");
+		printf("use: virtsim <tracefile> <nframes> [%s ...]\n", names);
+		printf("     virtsim mrc <tracefile> [rate [check]]\n");
+		return 1;
+	}
+
+	nframes = atoi(argv[2]);
+	if (nframes <= 0) {
+		fprintf(stderr, "nframes must be positive\n");
+		return 1;
+	}
+
+	for (i = 3; i < argc; i++) {
+		if (!policy_lookup(argv[i])) {
+			policy_names(names, sizeof(names), ", ");
+			fprintf(stderr, "unknown algorithm: %s. Must be one of %s\n", argv[i], names);
+			return 1;
+		}
+	}
+
+	uint32_t *refs = trace_load(argv[1], &npages, &count);
+	if (!refs) return 1;
+
+	printf("%s: %d pages, %lld references, %d frames\n\n", argv[1], npages, (long long)count, nframes);
+	printf("%-10s %10s %10s %10s %10s %10s\n", "policy", "faults", "reads", "writes", "reffaults", "Mrefs/s");
+
+	//With no algorithms named, every registered policy is run
+	if (argc == 3) {
+		const struct policy *policy;
+		for (i = 0; (policy = policy_at(i)); i++) {
+			simulate(policy, refs, count, npages, nframes);
+		}
+	} else {
+		for (i = 3; i < argc; i++) {
+			simulate(policy_lookup(argv[i]), refs, count, npages, nframes);
+		}
+	}
+
+	//Belady's MIN goes last, as the bound the rows above can be measured against
+	simulate_opt(refs, count, npages, nframes);
+
+	free(refs);
+	return 0;
+}